@@ -0,0 +1,232 @@
+/*
+ * uniprof: calling-context tree
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <calling-context.h>
+#include <trace-format.h>
+
+#define CCT_INITIAL_NODES 4096
+
+static uint32_t slot_of(cct_t *cct, uint32_t parent, uint64_t addr)
+{
+	uint64_t h = (addr ^ ((uint64_t)parent << 32 | parent)) * 0x9e3779b97f4a7c15ULL;
+
+	return (h >> 32) & (cct->index_size - 1);
+}
+
+static int grow_index(cct_t *cct)
+{
+	uint32_t size = cct->index_size * 2;
+	uint32_t i, slot;
+	uint32_t *index;
+
+	if (size == 0)
+		return -1;
+	index = calloc(size, sizeof(uint32_t));
+	if (!index)
+		return -1;
+	free(cct->index);
+	cct->index = index;
+	cct->index_size = size;
+	for (i = 1; i < cct->nr_nodes; i++) {
+		slot = slot_of(cct, cct->nodes[i].parent, cct->nodes[i].addr);
+		while (cct->index[slot])
+			slot = (slot + 1) & (size - 1);
+		cct->index[slot] = i;
+	}
+	return 0;
+}
+
+/* return the index of the child of parent with address addr, creating it if necessary */
+static int64_t child(cct_t *cct, uint32_t parent, uint64_t addr)
+{
+	cct_node_t *nodes;
+	uint32_t slot, i;
+
+	slot = slot_of(cct, parent, addr);
+	while ((i = cct->index[slot]) != 0) {
+		if (cct->nodes[i].parent == parent && cct->nodes[i].addr == addr)
+			return i;
+		slot = (slot + 1) & (cct->index_size - 1);
+	}
+
+	if (cct->nr_nodes == UINT32_MAX)
+		return -1;
+	if (cct->nr_nodes == cct->nodes_size) {
+		nodes = realloc(cct->nodes, 2 * (size_t)cct->nodes_size * sizeof(cct_node_t));
+		if (!nodes)
+			return -1;
+		cct->nodes = nodes;
+		cct->nodes_size *= 2;
+	}
+	// keep the index at most half full; never let it fill up completely
+	if (((uint64_t)cct->nr_nodes + 1) * 2 > cct->index_size) {
+		if (grow_index(cct) == 0)
+			slot = slot_of(cct, parent, addr);
+		else if (cct->nr_nodes + 1 >= cct->index_size)
+			return -1;
+		while (cct->index[slot])
+			slot = (slot + 1) & (cct->index_size - 1);
+	}
+	i = cct->nr_nodes++;
+	cct->nodes[i].addr = addr;
+	cct->nodes[i].count = 0;
+	cct->nodes[i].parent = parent;
+	cct->index[slot] = i;
+	return i;
+}
+
+cct_t *cct_create(void)
+{
+	cct_t *cct;
+
+	cct = calloc(1, sizeof(cct_t));
+	if (!cct)
+		return NULL;
+	cct->nodes_size = CCT_INITIAL_NODES;
+	cct->nodes = malloc(cct->nodes_size * sizeof(cct_node_t));
+	cct->index_size = 2 * CCT_INITIAL_NODES;
+	cct->index = calloc(cct->index_size, sizeof(uint32_t));
+	if (!cct->nodes || !cct->index) {
+		cct_destroy(cct);
+		return NULL;
+	}
+	cct->nodes[CCT_ROOT].addr = 0;
+	cct->nodes[CCT_ROOT].count = 0;
+	cct->nodes[CCT_ROOT].parent = CCT_ROOT;
+	cct->nr_nodes = 1;
+	return cct;
+}
+
+void cct_destroy(cct_t *cct)
+{
+	if (!cct)
+		return;
+	free(cct->nodes);
+	free(cct->index);
+	free(cct);
+}
+
+int cct_insert(cct_t *cct, const uint64_t *frames, unsigned int nr_frames, bool complete)
+{
+	int64_t node = CCT_ROOT;
+	unsigned int i;
+
+	if (!complete)
+		node = child(cct, node, CCT_TRUNCATED);
+	for (i = nr_frames; i-- > 0 && node >= 0; )
+		node = child(cct, node, frames[i]);
+	if (node < 0)
+		return -1;
+	cct->nodes[node].count++;
+	cct->samples++;
+	return 0;
+}
+
+int cct_write(cct_t *cct, FILE *f)
+{
+	unsigned char buf[3 * 10];
+	cct_node_t *n;
+	uint32_t i;
+	size_t len;
+
+	memcpy(buf, CCT_MAGIC, 8);
+	for (i = 0; i < 4; i++) {
+		buf[8 + i] = (CCT_VERSION >> (8 * i)) & 0xff;
+		buf[12 + i] = (cct->nr_nodes >> (8 * i)) & 0xff;
+	}
+	if (fwrite(buf, 16, 1, f) != 1)
+		return -1;
+	len = trace_put_varint(buf, cct->nodes[CCT_ROOT].count);
+	if (fwrite(buf, len, 1, f) != 1)
+		return -1;
+	for (i = 1; i < cct->nr_nodes; i++) {
+		n = &cct->nodes[i];
+		len = trace_put_varint(buf, i - n->parent);
+		len += trace_put_varint(buf + len, trace_zigzag(cct->nodes[n->parent].addr, n->addr));
+		len += trace_put_varint(buf + len, n->count);
+		if (fwrite(buf, len, 1, f) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+cct_t *cct_read(FILE *f)
+{
+	unsigned char buf[16];
+	uint64_t dist, z, count;
+	uint32_t nr_nodes = 0, i;
+	cct_node_t *n;
+	cct_t *cct;
+
+	if (fread(buf, 16, 1, f) != 1 || memcmp(buf, CCT_MAGIC, 8))
+		return NULL;
+	if ((buf[8] | buf[9] << 8 | buf[10] << 16 | (uint32_t)buf[11] << 24) != CCT_VERSION)
+		return NULL;
+	for (i = 0; i < 4; i++)
+		nr_nodes |= (uint32_t)buf[12 + i] << (8 * i);
+	if (nr_nodes == 0)
+		return NULL;
+
+	cct = calloc(1, sizeof(cct_t));
+	if (!cct)
+		return NULL;
+	// a tree we read is only for walking, it doesn't need an index
+	cct->nodes = malloc(nr_nodes * sizeof(cct_node_t));
+	if (!cct->nodes || trace_get_varint(f, &count))
+		goto out_err;
+	cct->nodes_size = nr_nodes;
+	cct->nr_nodes = nr_nodes;
+	cct->nodes[CCT_ROOT].addr = 0;
+	cct->nodes[CCT_ROOT].parent = CCT_ROOT;
+	cct->nodes[CCT_ROOT].count = count;
+	cct->samples = count;
+	for (i = 1; i < nr_nodes; i++) {
+		if (trace_get_varint(f, &dist) || trace_get_varint(f, &z) || trace_get_varint(f, &count))
+			goto out_err;
+		if (dist == 0 || dist > i)
+			goto out_err;
+		n = &cct->nodes[i];
+		n->parent = i - dist;
+		n->addr = trace_unzigzag(cct->nodes[n->parent].addr, z);
+		n->count = count;
+		cct->samples += count;
+	}
+	return cct;
+
+out_err:
+	cct_destroy(cct);
+	return NULL;
+}
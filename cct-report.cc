@@ -0,0 +1,181 @@
+/*
+ * calling-context tree report (for use with uniprof)
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <calling-context.h>
+
+static std::map<uint64_t, std::string> symbollist;
+
+/* name of the function addr is in, or the address if we have no symbols */
+static std::string symbol_name(uint64_t addr) {
+	std::map<uint64_t, std::string>::iterator iter;
+	std::stringstream s;
+
+	if (addr == CCT_TRUNCATED)
+		return "[truncated]";
+	if (addr == CCT_IDLE)
+		return "[idle]";
+	iter = symbollist.upper_bound(addr);
+	if (iter == symbollist.begin()) {
+		s << "0x" << std::hex << addr;
+		return s.str();
+	}
+	iter--;
+	return iter->second;
+}
+
+static void print_folded(cct_t *cct) {
+	std::vector<std::string> path;
+	uint32_t i, n;
+
+	if (cct->nodes[CCT_ROOT].count)
+		std::cout << "[unknown] " << cct->nodes[CCT_ROOT].count << std::endl;
+	for (i = 1; i < cct->nr_nodes; i++) {
+		if (!cct->nodes[i].count)
+			continue;
+		path.clear();
+		for (n = i; n != CCT_ROOT; n = cct->nodes[n].parent)
+			path.push_back(symbol_name(cct->nodes[n].addr));
+		for (n = path.size(); n-- > 0; )
+			std::cout << path[n] << (n ? ";" : " ");
+		std::cout << std::dec << cct->nodes[i].count << std::endl;
+	}
+}
+
+static void print_callgraph(cct_t *cct, std::vector<uint64_t> &total,
+		std::vector<std::vector<uint32_t> > &children, uint32_t node, unsigned int depth) {
+	std::vector<uint32_t> &c = children[node];
+	char percent[16];
+	size_t i;
+
+	snprintf(percent, sizeof(percent), "%6.2f%%", 100.0 * total[node] / cct->samples);
+	std::cout << percent << " " << std::string(2 * depth, ' ') << symbol_name(cct->nodes[node].addr)
+		<< " (" << std::dec << total[node] << ")" << std::endl;
+	for (i = 0; i < c.size(); i++)
+		print_callgraph(cct, total, children, c[i], depth + 1);
+}
+
+struct heavier {
+	std::vector<uint64_t> &total;
+	heavier(std::vector<uint64_t> &t) : total(t) {}
+	bool operator()(uint32_t a, uint32_t b) const { return total[a] > total[b]; }
+};
+
+/* indented call tree with inclusive sample counts, heaviest callees first */
+static void print_callgraph(cct_t *cct) {
+	std::vector<uint64_t> total(cct->nr_nodes);
+	std::vector<std::vector<uint32_t> > children(cct->nr_nodes);
+	uint32_t i;
+
+	if (!cct->samples)
+		return;
+	// children always come after their parents, so one backwards pass is enough
+	for (i = cct->nr_nodes; i-- > 0; ) {
+		total[i] += cct->nodes[i].count;
+		if (i != CCT_ROOT) {
+			total[cct->nodes[i].parent] += total[i];
+			children[cct->nodes[i].parent].push_back(i);
+		}
+	}
+	for (i = 0; i < cct->nr_nodes; i++)
+		std::sort(children[i].begin(), children[i].end(), heavier(total));
+	for (i = 0; i < children[CCT_ROOT].size(); i++)
+		print_callgraph(cct, total, children, children[CCT_ROOT][i], 0);
+}
+
+int main(int argc, char **argv) {
+	std::ifstream symbolfile;
+	std::string line;
+	std::stringstream convertor;
+	uint64_t addr;
+	char type;
+	std::string fname;
+	bool callgraph = false;
+	FILE *f;
+	cct_t *cct;
+
+	if (argc > 1 && !strcmp(argv[1], "-c")) {
+		callgraph = true;
+		argv++;
+		argc--;
+	}
+	if (argc != 2 && argc != 3) {
+		std::cout << "Usage: " << argv[0] << " [-c] <cct_file> [<symbol_table>]" << std::endl;
+		std::cout << "Writes folded stacks, or with -c, a call graph." << std::endl;
+		return 1;
+	}
+
+	if (argc == 3) {
+		symbolfile.open(argv[2], std::ifstream::in);
+		if (symbolfile.fail()) {
+			std::cout << "Failed opening symbol table file \"" << argv[2] << "\".";
+			return 2;
+		}
+		while (std::getline(symbolfile, line)) {
+			convertor.str(line);
+			convertor >> std::hex >> addr >> type >> fname;
+			convertor.clear();
+			symbollist[addr] = fname;
+		}
+		symbolfile.close();
+	}
+
+	f = fopen(argv[1], "r");
+	if (!f) {
+		std::cout << "Failed opening calling-context tree file \"" << argv[1] << "\".";
+		return 2;
+	}
+	cct = cct_read(f);
+	fclose(f);
+	if (!cct) {
+		std::cout << "\"" << argv[1] << "\" is not a valid calling-context tree file.";
+		return 3;
+	}
+
+	if (callgraph)
+		print_callgraph(cct);
+	else
+		print_folded(cct);
+	cct_destroy(cct);
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * uniprof: calling-context tree
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __CALLING_CONTEXT_H
+#define __CALLING_CONTEXT_H
+/**
+ * calling-context.h
+ *
+ * Calling-context tree: a prefix tree of all sampled stacks, rooted at the
+ * outermost frame. Every sample adds one to the count of the node for its
+ * innermost frame. Samples share the nodes of their common callers, so the
+ * tree only grows with the number of distinct code paths, not with the
+ * number of samples.
+ *
+ * Nodes live in one array and refer to their parent by index; a parent
+ * always comes before its children. Children are found through a hash
+ * table keyed by (parent, address).
+ *
+ * On disk, a tree is the magic "UNIPCCT\0", a u32 version and a u32 node
+ * count (both little-endian), followed by the nodes in order, starting
+ * with the root. Each node is three varints (see trace-format.h): the
+ * distance to its parent's index, its address as the zigzag-encoded
+ * difference to its parent's address, and its count. The root only has a
+ * count.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CCT_MAGIC "UNIPCCT"     /* plus the terminating NUL: 8 bytes */
+#define CCT_VERSION 1
+#define CCT_ROOT 0
+/* stacks we could not walk to the end hang off a node with this address */
+#define CCT_TRUNCATED UINT64_MAX
+/* samples of idle or offline vCPUs */
+#define CCT_IDLE (UINT64_MAX - 1)
+
+typedef struct {
+	uint64_t addr;
+	uint64_t count;         /* samples with this node as innermost frame */
+	uint32_t parent;
+} cct_node_t;
+
+typedef struct {
+	cct_node_t *nodes;
+	uint32_t nr_nodes;
+	uint32_t nodes_size;
+	uint32_t *index;        /* node indices, 0 (the root) marks a free slot */
+	uint32_t index_size;    /* a power of two */
+	unsigned long long samples;
+} cct_t;
+
+cct_t *cct_create(void);
+void cct_destroy(cct_t *cct);
+/**
+ * Add one sample. frames are ordered innermost first, as a stack walk
+ * produces them. Returns 0 on success, -1 if out of memory.
+ */
+int cct_insert(cct_t *cct, const uint64_t *frames, unsigned int nr_frames, bool complete);
+/* Returns 0 on success, -1 on write errors. */
+int cct_write(cct_t *cct, FILE *f);
+/* Returns a new tree, or NULL if f does not contain a valid one. */
+cct_t *cct_read(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CALLING_CONTEXT_H */
@@ -0,0 +1,97 @@
+/*
+ * uniprof: per-phase timing of the sampling hot path
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __INSTRUMENT_H
+#define __INSTRUMENT_H
+/**
+ * instrument.h
+ *
+ * Optional instrumentation that breaks down where the time of each sample
+ * goes, and how many hypercalls and foreign mappings it takes. It is only
+ * built with --enable-instrumentation (WITH_INSTRUMENTATION); otherwise,
+ * the INSTR_* macros expand to nothing, and the rest must not be used.
+ *
+ * Times are taken from CLOCK_MONOTONIC_RAW, which is read through the
+ * vDSO, so it is cheap, but not subject to NTP slewing. Any thread can add
+ * to the sample that is currently being taken; the sampling thread closes
+ * it with instr_end_sample(). Some phases are nested in others (see
+ * instr_phase_t), so phase times don't add up to the time of a sample.
+ */
+
+#include <config.h>
+
+#ifdef WITH_INSTRUMENTATION
+#include <stdint.h>
+#include <stdio.h>
+#include <timer.h>
+
+typedef enum {
+	INSTR_PAUSE,                    /* pausing the domain */
+	INSTR_CONTEXTS,                 /* fetching vCPU states and contexts */
+	INSTR_WALK,                     /* walking or copying the stacks */
+	INSTR_MAP,                      /* mapping guest pages, part of the above */
+	INSTR_UNPAUSE,                  /* unpausing the domain */
+	INSTR_OUTPUT,                   /* unwinding snapshots, symbols, and output */
+	INSTR_SYMBOLS,                  /* symbol lookups, part of the above */
+	INSTR_NR_PHASES
+} instr_phase_t;
+
+typedef enum {
+	INSTR_HYPERCALLS,
+	INSTR_MAPPINGS,                 /* guest pages mapped */
+	INSTR_NR_COUNTERS
+} instr_counter_t;
+
+void instr_add(instr_phase_t phase, uint64_t nsecs);
+void instr_count(instr_counter_t counter);
+/**
+ * Also write one line per sample with the time of each phase and the
+ * counters to the CSV file name. Returns 0 on success, or -1.
+ */
+int instr_open_csv(const char *name);
+/* file what was added since the last call under a sample of domid taken at timestamp */
+void instr_end_sample(int domid, uint64_t timestamp);
+/* print percentiles for each phase and counter, and close the CSV file */
+void instr_finish(FILE *f);
+
+#define INSTR_START(t) uint64_t t = sample_timer_now()
+#define INSTR_STOP(phase, t) instr_add(phase, sample_timer_now() - (t))
+#define INSTR_COUNT(counter) instr_count(counter)
+#else
+#define INSTR_START(t)
+#define INSTR_STOP(phase, t) do { } while (0)
+#define INSTR_COUNT(counter) do { } while (0)
+#endif /* WITH_INSTRUMENTATION */
+
+#endif /* __INSTRUMENT_H */
@@ -0,0 +1,95 @@
+/*
+ * uniprof: bounded cache of mapped guest pages
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __PAGE_CACHE_H
+#define __PAGE_CACHE_H
+/**
+ * page-cache.h
+ *
+ * Fixed-capacity cache of foreign page mappings, keyed by a page-aligned
+ * address. Lookups go through an open-addressed (linear probing) hash index,
+ * and once the cache is full, a CLOCK sweep picks the page to evict. Evicted
+ * pages are unmapped, so the number of mappings held in dom0 stays bounded
+ * no matter how long we trace.
+ */
+
+#include <stdint.h>
+#include <xen-interface.h>
+
+typedef struct {
+	guest_word_t base;
+	unsigned long mfn;
+	void *buf;
+	int referenced;
+} page_cache_entry_t;
+
+typedef struct {
+	unsigned int capacity;   /* maximum number of mapped pages */
+	unsigned int used;       /* entries currently in use */
+	unsigned int hand;       /* CLOCK hand, index into entries */
+	unsigned int index_mask; /* index has index_mask+1 slots */
+	int32_t *index;          /* hash slot -> entry number, -1 if empty */
+	page_cache_entry_t *entries;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+} page_cache_t;
+
+#define PAGE_CACHE_DEFAULT_CAPACITY 1024
+/* entries are numbered with int32_t, and the index has twice as many slots */
+#define PAGE_CACHE_MAX_CAPACITY (1U << 24)
+
+/**
+ * Allocate a cache that holds at most capacity pages (at most
+ * PAGE_CACHE_MAX_CAPACITY).
+ * Returns NULL on failure.
+ */
+page_cache_t *page_cache_create(unsigned int capacity);
+/**
+ * Unmap all pages still held by the cache and free it.
+ */
+void page_cache_destroy(page_cache_t *pc);
+/**
+ * Return the host address of the mapping for the page starting at
+ * base, or NULL if that page is not cached.
+ */
+void *page_cache_lookup(page_cache_t *pc, guest_word_t base);
+/**
+ * Add a freshly mapped page to the cache. If the cache is full, the
+ * least recently referenced page (according to CLOCK) is unmapped and
+ * replaced. The cache takes ownership of the mapping in buf.
+ */
+void page_cache_insert(page_cache_t *pc, guest_word_t base, unsigned long mfn, void *buf);
+
+#endif /* __PAGE_CACHE_H */
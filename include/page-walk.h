@@ -0,0 +1,89 @@
+/*
+ * uniprof: guest page table walkers
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __PAGE_WALK_H
+#define __PAGE_WALK_H
+/**
+ * page-walk.h
+ *
+ * Page table walkers for the architectures uniprof supports. They only
+ * compute translations; getting at the page table pages is left to a
+ * callback, so the walkers don't depend on Xen at all and can just as
+ * well run over page tables set up in local memory.
+ */
+
+#include <stdint.h>
+
+#define PAGE_WALK_SHIFT 12
+
+/**
+ * Callback returning a pointer to the (at least 4 KiB sized) page table
+ * page with frame number pfn, or NULL if it cannot be accessed. The
+ * pointer only needs to stay valid until the next call.
+ */
+typedef void *(*page_walk_map_fn)(void *opaque, uint64_t pfn);
+
+/**
+ * Walk x86 PAE/long mode page tables with levels levels (3 or 4), starting
+ * at the top-level table in frame table_pfn. Walks stop early at entries
+ * with the PS bit set, i.e., 2 MiB and 1 GiB pages. Returns the frame
+ * number that virt is mapped to, or 0 if it isn't mapped. On success,
+ * *page_shift is set to the log2 of the size of the page containing virt.
+ */
+unsigned long page_walk_x86(uint64_t table_pfn, int levels, uint64_t virt,
+		page_walk_map_fn map, void *opaque, int *page_shift);
+
+/**
+ * Walk ARM long-descriptor page tables with a 4 KiB granule, as used by
+ * AArch64 and by ARMv7 with LPAE. table_addr is the physical address of the
+ * initial lookup level table (i.e., the base address from TTBRx), va_bits is
+ * the size of the input address range (64 - TxSZ on AArch64, 32 - TxSZ with
+ * LPAE), which also determines the initial lookup level. Walks stop early at
+ * block descriptors (1 GiB at level 1, 2 MiB at level 2). Returns the frame
+ * number that virt is mapped to, or 0 if it isn't mapped, and sets
+ * *page_shift like page_walk_x86().
+ */
+unsigned long page_walk_arm_long(uint64_t table_addr, int va_bits, uint64_t virt,
+		page_walk_map_fn map, void *opaque, int *page_shift);
+
+/**
+ * Walk ARMv7 short-descriptor page tables. table_addr is the physical
+ * address of the first-level table (i.e., the base address from TTBRx).
+ * Handles sections and supersections as well as large and small pages
+ * behind second-level tables. Return value and *page_shift as above.
+ */
+unsigned long page_walk_arm_short(uint64_t table_addr, uint32_t virt,
+		page_walk_map_fn map, void *opaque, int *page_shift);
+
+#endif /* __PAGE_WALK_H */
@@ -0,0 +1,84 @@
+/*
+ * uniprof: single-producer single-consumer ring of fixed-size slots
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __SAMPLE_RING_H
+#define __SAMPLE_RING_H
+/**
+ * sample-ring.h
+ *
+ * Lock-free ring buffer handing samples from the sampling thread to a
+ * background thread. Slots have a fixed size and are allocated up front,
+ * and the producer never blocks: if all slots are in use, reserving one
+ * fails, and it's up to the producer to drop the sample.
+ *
+ * Only one thread may produce (reserve/publish) and only one may consume
+ * (peek/release) at any time.
+ */
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+typedef struct {
+	unsigned int nr_slots;          /* a power of two */
+	size_t slot_size;
+	unsigned char *slots;
+	atomic_ulong head;              /* next slot to publish, written by the producer */
+	atomic_ulong tail;              /* next slot to consume, written by the consumer */
+} sample_ring_t;
+
+/**
+ * Allocate a ring with nr_slots (rounded up to a power of two) zeroed
+ * slots of slot_size bytes each. Returns NULL on failure.
+ */
+sample_ring_t *sample_ring_create(unsigned int nr_slots, size_t slot_size);
+void sample_ring_destroy(sample_ring_t *ring);
+/**
+ * Return slot number i, regardless of its state. Only meant for setting
+ * up slots before the ring is used.
+ */
+void *sample_ring_slot(sample_ring_t *ring, unsigned int i);
+/**
+ * Producer: return the next free slot, or NULL if the ring is full. The
+ * slot only becomes visible to the consumer with sample_ring_publish().
+ */
+void *sample_ring_reserve(sample_ring_t *ring);
+void sample_ring_publish(sample_ring_t *ring);
+/**
+ * Consumer: return the oldest published slot, or NULL if there is none.
+ * The slot is handed back to the producer with sample_ring_release().
+ */
+void *sample_ring_peek(sample_ring_t *ring);
+void sample_ring_release(sample_ring_t *ring);
+
+#endif /* __SAMPLE_RING_H */
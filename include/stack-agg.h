@@ -0,0 +1,81 @@
+/*
+ * uniprof: aggregation of identical stack traces
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __STACK_AGG_H
+#define __STACK_AGG_H
+/**
+ * stack-agg.h
+ *
+ * Counts how often each distinct stack trace was seen. Stacks are kept in
+ * an open-addressing hash table, their frames in one growing array, so
+ * memory use only depends on the number of distinct stacks, not on the
+ * number of samples.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	uint64_t hash;
+	uint64_t count;         /* 0 marks an unused slot */
+	size_t frames;          /* index of the first frame in the frame array */
+	unsigned int nr_frames;
+	bool complete;
+} stack_agg_entry_t;
+
+typedef struct {
+	size_t capacity;        /* a power of two */
+	size_t used;
+	stack_agg_entry_t *entries;
+	uint64_t *frames;
+	size_t nr_frames;
+	size_t frames_size;
+	unsigned long long samples;
+} stack_agg_t;
+
+typedef void (*stack_agg_fn)(void *opaque, const uint64_t *frames, unsigned int nr_frames,
+		bool complete, uint64_t count);
+
+stack_agg_t *stack_agg_create(void);
+void stack_agg_destroy(stack_agg_t *agg);
+/**
+ * Count one occurrence of the given stack. Returns 0 on success, or -1 if
+ * memory for a new stack could not be allocated.
+ */
+int stack_agg_add(stack_agg_t *agg, const uint64_t *frames, unsigned int nr_frames, bool complete);
+/* call fn once for every distinct stack, in no particular order */
+void stack_agg_foreach(stack_agg_t *agg, stack_agg_fn fn, void *opaque);
+
+#endif /* __STACK_AGG_H */
@@ -0,0 +1,164 @@
+/*
+ * uniprof: cache-friendly index of symbols by address
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __SYMBOL_INDEX_H
+#define __SYMBOL_INDEX_H
+/**
+ * symbol-index.h
+ *
+ * Static index of symbols by their 64-bit start address, answering "which
+ * symbol contains this address", i.e., which one has the largest address
+ * not above it. Symbols are added first, then the index is built once and
+ * only searched from then on.
+ *
+ * The addresses are stored in Eytzinger (breadth-first) order, padded to a
+ * complete tree, so a lookup is a fixed number of branch-free steps down
+ * the tree. Each cache line holds eight addresses, i.e., the nodes of
+ * three consecutive levels, and we prefetch the line three levels ahead.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	uint64_t addr;
+	uint32_t name;           /* offset into the string arena, 0 for padding */
+	uint32_t size;           /* in bytes, 0 if unknown (up to the next symbol) */
+} symbol_t;
+
+typedef struct {
+	unsigned int num;        /* symbols that fit before we have to grow */
+	unsigned int filled;     /* symbols added so far */
+	unsigned int levels;     /* depth of the padded tree */
+	unsigned int size;       /* 2^levels - 1 slots, numbered from 1 */
+	uint64_t *keys;          /* start addresses in Eytzinger order */
+	symbol_t *slots;         /* the symbols in Eytzinger order */
+	symbol_t *sorted;        /* while adding: the symbols in the order given */
+	uint64_t first;          /* lowest and highest address in the index */
+	uint64_t last;
+	unsigned int last_slot;  /* slot of the symbol at last */
+	/* the code the text symbols cover, from text_start up to (not
+	 * including) text_end. While adding, text_end is the start of the
+	 * highest text symbol, and text_last_size its size. */
+	uint64_t text_start;
+	uint64_t text_end;
+	uint64_t text_last_size;
+	/* all names, NUL-terminated, one after the other. Identical names
+	 * are only stored once. Offset 0 is the empty string. Offsets are
+	 * 32 bits wide, so there can be at most 4 GiB of names. */
+	char *strings;
+	size_t strings_len;
+	size_t strings_size;
+	uint32_t *interned;      /* while adding: hash of names -> offset, 0 if empty */
+	size_t interned_mask;
+	size_t nr_interned;
+	void *map;               /* the cache file, if the index was mapped from one */
+	size_t map_size;
+	bool cache_written;      /* whether symbol_index_open() (re)wrote the cache file */
+} symbol_index_t;
+
+/**
+ * Allocate an index, with room for num symbols to start with.
+ * Returns NULL on failure.
+ */
+symbol_index_t *symbol_index_create(unsigned int num);
+/**
+ * Free the index, including all names.
+ */
+void symbol_index_destroy(symbol_index_t *idx);
+/**
+ * Add a symbol of size bytes (0 if unknown), with the len characters at
+ * name as its name, which are copied. Returns 0 on success, or -ENOMEM.
+ */
+int symbol_index_add(symbol_index_t *idx, uint64_t addr, uint64_t size, const char *name, size_t len);
+/**
+ * Also count the symbol at addr, of size bytes (0 if unknown), as code,
+ * i.e., as part of the range from text_start to text_end. Without any such
+ * symbols, the range covers all symbols in the index.
+ */
+void symbol_index_add_text(symbol_index_t *idx, uint64_t addr, uint64_t size);
+/**
+ * Build the index from the symbols added so far, which may come in any
+ * order. If they aren't sorted by address yet, they are sorted, and of
+ * several symbols at the same address, only the last one added is kept.
+ * No symbols can be added afterwards. Returns 0 on success, or a negative
+ * value on failure.
+ */
+int symbol_index_build(symbol_index_t *idx);
+/**
+ * Add the symbols of name, which can be either of two formats:
+ *  - an ELF file (32 or 64 bits, either byte order). We take its function
+ *    symbols, from .symtab, or from .dynsym if it has no .symtab.
+ *  - the output of nm, or Linux' /proc/kallsyms: one "address type name"
+ *    per line. Lines without a hexadecimal address and a name are skipped.
+ * Returns the number of symbols added, or a negative errno value.
+ */
+int symbol_index_read(symbol_index_t *idx, const char *name);
+/**
+ * Return a built index of the symbols in name (see symbol_index_read()).
+ * The index is cached in name.symidx: if that file was made from the
+ * current version of name, it is simply mapped, otherwise it is written
+ * anew, if the directory is writable. On failure, returns NULL, and sets
+ * *err to a negative errno value, or to 0 if name has no symbols at all.
+ */
+symbol_index_t *symbol_index_open(const char *name, int *err);
+/**
+ * Return the symbol with the largest address not above addr, or NULL if
+ * addr lies below all symbols, or past the end of that symbol if we know
+ * its size.
+ */
+const symbol_t *symbol_index_lookup(const symbol_index_t *idx, uint64_t addr);
+/**
+ * Look up nr addresses at once, e.g., all frames of a stack, storing the
+ * result for addrs[i] in syms[i]. The searches are interleaved, so their
+ * cache misses overlap instead of being paid one after the other.
+ */
+void symbol_index_lookup_batch(const symbol_index_t *idx, const uint64_t *addrs,
+		unsigned int nr, const symbol_t **syms);
+
+static inline const char *symbol_name(const symbol_index_t *idx, const symbol_t *sym)
+{
+	return idx->strings + sym->name;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SYMBOL_INDEX_H */
@@ -0,0 +1,83 @@
+/*
+ * uniprof: memo of formatted symbol lookups
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __SYMBOL_MEMO_H
+#define __SYMBOL_MEMO_H
+/**
+ * symbol-memo.h
+ *
+ * Two-way set-associative cache from an address to the text we print for it
+ * (e.g., "schedule+0x230\n"). Stacks mostly consist of the same few hundred
+ * return addresses, so most frames can be printed without a symbol lookup
+ * or any formatting. Two addresses can share a set without evicting each
+ * other; a third one replaces the one of them that was used less recently.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	uint64_t addr;
+	char *text;             /* NULL if the entry is unused */
+	size_t len;
+} symbol_memo_entry_t;
+
+typedef struct {
+	unsigned int mask;      /* entries has mask+1 entries, in sets of two */
+	symbol_memo_entry_t *entries;
+	unsigned long long hits;
+	unsigned long long misses;
+} symbol_memo_t;
+
+#define SYMBOL_MEMO_DEFAULT_ENTRIES 4096
+
+/**
+ * Allocate a memo with nr_entries entries, rounded up to a power of two
+ * (and at least two).
+ * Returns NULL on failure.
+ */
+symbol_memo_t *symbol_memo_create(unsigned int nr_entries);
+void symbol_memo_destroy(symbol_memo_t *memo);
+/**
+ * Return the text remembered for addr, and its length in *len, or NULL if
+ * there is none.
+ */
+const char *symbol_memo_lookup(symbol_memo_t *memo, uint64_t addr, size_t *len);
+/**
+ * Remember the len bytes at text (which are copied) for addr. Returns 0 on
+ * success, or -1 if there was no memory for them.
+ */
+int symbol_memo_insert(symbol_memo_t *memo, uint64_t addr, const char *text, size_t len);
+
+#endif /* __SYMBOL_MEMO_H */
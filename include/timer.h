@@ -0,0 +1,115 @@
+/*
+ * uniprof: absolute-deadline sampling timer and latency histograms
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+/**
+ * timer.h
+ *
+ * Waits for absolute deadlines on CLOCK_MONOTONIC, so that errors in one
+ * wake-up don't carry over into the next, and records how late we woke up
+ * in a log-linear histogram.
+ *
+ * A timer sleeps until shortly before the deadline, either with
+ * clock_nanosleep() or a timerfd, and busy-waits for the rest, which
+ * absorbs the scheduler's wake-up latency. It can also busy-wait all the
+ * time, which is the most precise, but keeps a CPU busy.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef enum {
+	SAMPLE_TIMER_SLEEP,             /* clock_nanosleep(TIMER_ABSTIME) */
+	SAMPLE_TIMER_TIMERFD,           /* a timerfd with TFD_TIMER_ABSTIME */
+	SAMPLE_TIMER_SPIN,              /* busy-wait only */
+} sample_timer_mode_t;
+
+typedef struct {
+	sample_timer_mode_t mode;
+	int fd;                         /* the timerfd, or -1 */
+	uint64_t spin_nsec;             /* busy-wait this long before each deadline */
+} sample_timer_t;
+
+/* values below 2^LATENCY_HIST_SUB_BITS ns are exact, others within ~3% */
+#define LATENCY_HIST_SUB_BITS 5
+#define LATENCY_HIST_BUCKETS ((64 - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS)
+
+typedef struct {
+	unsigned long long count;
+	unsigned long long max;
+	unsigned long long counts[LATENCY_HIST_BUCKETS];
+} latency_hist_t;
+
+/* the current CLOCK_MONOTONIC time in nanoseconds, for all of uniprof's timing */
+static inline uint64_t sample_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Set up a timer that busy-waits for the last spin_nsec before each
+ * deadline (with SAMPLE_TIMER_SPIN, it always does). Returns 0 on success,
+ * or -1 if the timerfd could not be created.
+ */
+int sample_timer_init(sample_timer_t *timer, sample_timer_mode_t mode, uint64_t spin_nsec);
+void sample_timer_destroy(sample_timer_t *timer);
+/**
+ * Wait until deadline (CLOCK_MONOTONIC, in nanoseconds), and return the
+ * time we got back. Returns right away if the deadline has passed.
+ */
+uint64_t sample_timer_wait(sample_timer_t *timer, uint64_t deadline);
+/* pin the calling thread to cpu. Returns 0 on success, or -1. */
+int sample_timer_pin(int cpu);
+/**
+ * Run the calling thread with SCHED_FIFO at the given priority, and lock
+ * all of the process's memory, so that neither other tasks nor page
+ * faults can delay a wake-up. Returns 0 on success, or -1 with errno set.
+ */
+int sample_timer_realtime(int priority);
+
+void latency_hist_add(latency_hist_t *hist, unsigned long long nsecs);
+/**
+ * The value that pct percent of all recorded values are at or below,
+ * rounded up to the end of its bucket. Returns 0 for an empty histogram.
+ */
+unsigned long long latency_hist_percentile(const latency_hist_t *hist, double pct);
+/* print a one-line percentile summary */
+void latency_hist_print(FILE *f, const char *what, const latency_hist_t *hist);
+
+#endif /* __TIMER_H */
@@ -0,0 +1,158 @@
+/*
+ * uniprof: binary trace format
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TRACE_FORMAT_H
+#define __TRACE_FORMAT_H
+/**
+ * trace-format.h
+ *
+ * Compact binary alternative to the text trace format. A trace starts with
+ * a fixed-size header (all fields little-endian):
+ *
+ *   magic "UNIPROF\0", u16 version, u16 word size, u32 domid,
+ *   u32 sampling frequency, u8 backend, 3 bytes padding,
+ *   u64 start time (CLOCK_REALTIME, ns)
+ *
+ * followed by records, each starting with a one-byte tag. A sample record
+ * (TRACE_REC_SAMPLE) holds, as unsigned LEB128 varints, the vCPU id, the
+ * time since the previous sample (CLOCK_MONOTONIC, ns; the first sample is
+ * relative to 0), and the number of frames, then one byte that is 1 for a
+ * complete stack walk and 0 otherwise, then the frames. Every frame is
+ * stored as the zigzag-encoded difference to the frame before it, with the
+ * first frame of a sample relative to the first frame of the previous one.
+ * Return addresses are close to each other, so most frames take two or
+ * three bytes instead of the 19 of a text line.
+ *
+ * Since version 2, a vCPU that was idle or offline is recorded as an idle
+ * record (TRACE_REC_IDLE) instead, with just the vCPU id and the time since
+ * the previous sample.
+ *
+ * Since version 3, a change of the sampling rate is recorded as a rate
+ * record (TRACE_REC_RATE) with the time since the previous sample and the
+ * new sampling period in ns. It applies to all samples after it, and the
+ * header's frequency to those before the first one.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC "UNIPROF"   /* plus the terminating NUL: 8 bytes */
+#define TRACE_VERSION 3
+#define TRACE_HEADER_SIZE 32
+
+#define TRACE_BACKEND_LIBXC 1
+#define TRACE_BACKEND_XENCALL 2
+
+#define TRACE_REC_SAMPLE 1
+#define TRACE_REC_IDLE 2
+#define TRACE_REC_RATE 3
+
+/* upper bound for an encoded sample with nr_frames frames */
+#define TRACE_SAMPLE_MAX_SIZE(nr_frames) (1 + 3 * 10 + 1 + (size_t)(nr_frames) * 10)
+
+typedef struct {
+	unsigned int version;
+	unsigned int word_size;
+	unsigned int domid;
+	unsigned int frequency;
+	unsigned int backend;
+	uint64_t start_time;
+} trace_header_t;
+
+typedef struct {
+	unsigned int vcpu;
+	uint64_t timestamp;
+	int complete;
+	int idle;                       /* an idle record, without frames */
+	int rate;                       /* a rate record, only timestamp and period are set */
+	uint64_t period;                /* the new sampling period of a rate record, in ns */
+	unsigned int nr_frames;
+	unsigned int frames_size;       /* capacity of frames, for the reader */
+	uint64_t *frames;
+} trace_sample_t;
+
+/* delta encoding state; both writer and reader start out zeroed */
+typedef struct {
+	uint64_t prev_frame;
+	uint64_t prev_time;
+} trace_codec_t;
+
+typedef struct {
+	FILE *f;
+	trace_header_t header;
+	trace_codec_t codec;
+} trace_reader_t;
+
+const char *trace_backend_name(unsigned int backend);
+
+/* unsigned LEB128; buf needs room for 10 bytes. Returns the bytes used */
+size_t trace_put_varint(unsigned char *buf, uint64_t val);
+/* read a varint from f. Returns 0 on success, -1 on EOF or overlong input */
+int trace_get_varint(FILE *f, uint64_t *val);
+/* map the difference to to from to small unsigned numbers: 0, -1, 1, -2, ... */
+uint64_t trace_zigzag(uint64_t from, uint64_t to);
+uint64_t trace_unzigzag(uint64_t from, uint64_t z);
+
+/* encode into buf, which needs at least TRACE_HEADER_SIZE bytes */
+size_t trace_encode_header(unsigned char *buf, const trace_header_t *h);
+/* encode into buf, which needs at least TRACE_SAMPLE_MAX_SIZE(s->nr_frames) bytes */
+size_t trace_encode_sample(unsigned char *buf, trace_codec_t *c, const trace_sample_t *s);
+
+/**
+ * Read the header of a binary trace from f. Returns 0 on success, 1 if f
+ * does not contain a binary trace (nothing can be assumed about the file
+ * position then), and a negative value on read errors or unsupported
+ * versions.
+ */
+int trace_reader_open(trace_reader_t *r, FILE *f);
+/**
+ * Read the next record into s. Returns 1 if a sample was read, 0 at the end
+ * of the trace, and a negative value if the trace is corrupt. s->frames is
+ * grown as needed; start with it zeroed, and free(s->frames) when done.
+ */
+int trace_read_sample(trace_reader_t *r, trace_sample_t *s);
+
+/* write the header lines of the text format for h */
+void trace_print_text_header(FILE *f, const trace_header_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRACE_FORMAT_H */
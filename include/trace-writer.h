@@ -0,0 +1,79 @@
+/*
+ * uniprof: buffered trace writer with a background I/O thread
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TRACE_WRITER_H
+#define __TRACE_WRITER_H
+/**
+ * trace-writer.h
+ *
+ * Trace output that never blocks on the file system while the domain is
+ * paused. Output is formatted into one of a few large buffers; full buffers
+ * are handed to a background thread that writes them out in order with
+ * writev(). The caller only waits (stalls) if all buffers are queued for
+ * writing, i.e., if the disk cannot keep up at all.
+ *
+ * A writer may only be used by one thread at a time.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#define TRACE_WRITER_NR_BUFFERS 4
+#define TRACE_WRITER_DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+	unsigned long long bytes_written;
+	unsigned long long writes;      /* number of write system calls */
+	unsigned long long stalls;      /* times the caller waited for a free buffer */
+	unsigned long long stall_nsec;  /* total time spent waiting */
+} trace_writer_stats_t;
+
+typedef struct trace_writer trace_writer_t;
+
+/**
+ * Start writing to fd, with buffers of buf_size bytes each. If close_fd is
+ * set, fd is closed by trace_writer_close(). Returns NULL on failure.
+ */
+trace_writer_t *trace_writer_open(int fd, size_t buf_size, int close_fd);
+/**
+ * Write out everything still buffered, stop the I/O thread and free the
+ * writer. Returns 0 if all output was written, or a negative errno value
+ * of the first failed write.
+ */
+int trace_writer_close(trace_writer_t *w, trace_writer_stats_t *stats);
+int trace_writer_write(trace_writer_t *w, const void *data, size_t len);
+int trace_writer_printf(trace_writer_t *w, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif /* __TRACE_WRITER_H */
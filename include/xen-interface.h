@@ -36,6 +36,7 @@
 #define __XEN_INTERFACE_H
 
 #include <config.h>
+#include <timer.h>
 
 #if defined(HYPERCALL_XENCALL) + defined(HYPERCALL_LIBXC) == 0
 #error Define exactly one of HYPERCALL_LIBXC, HYPERCALL_XENCALL
@@ -45,6 +46,7 @@
 
 #undef DBG
 #ifdef DEBUG
+#include <stdio.h>
 #define DBG(string, args...) printf("[DBG %s:%s] "string, __FILE__, __func__, ##args)
 #else
 #define DBG(args...)
@@ -56,14 +58,15 @@
 #include <xenforeignmemory.h>
 #define HYPERCALL_NAME "libxencall"
 typedef vcpu_guest_context_t vcpu_guest_context_transparent_t;
-extern xencall_handle *callh;
-extern xenforeignmemory_handle *fmemh;
+/* every thread has its own handles, see xen_interface_open() */
+extern __thread xencall_handle *callh;
+extern __thread xenforeignmemory_handle *fmemh;
 #elif defined(HYPERCALL_LIBXC)
 #define XC_WANT_COMPAT_MAP_FOREIGN_API
 #include <xenctrl.h>
 #define HYPERCALL_NAME "libxc"
 typedef vcpu_guest_context_any_t vcpu_guest_context_transparent_t;
-extern xc_interface *xc_handle;
+extern __thread xc_interface *xc_handle;
 #endif
 
 #ifndef __maybe_unused
@@ -77,16 +80,99 @@ extern xc_interface *xc_handle;
 // big enough for 32 bit and 64 bit
 typedef uint64_t guest_word_t;
 
+/* Open the hypervisor handles of the calling thread. Threads other than the
+ * main one close theirs with xen_interface_close_thread(), the main thread
+ * closes everything with xen_interface_close(). */
 int xen_interface_open(void);
+int xen_interface_close_thread(void);
 int xen_interface_close(void);
 int get_word_size(int domid);
 guest_word_t instruction_pointer(vcpu_guest_context_transparent_t *vc);
 guest_word_t frame_pointer(vcpu_guest_context_transparent_t *vc);
+guest_word_t stack_pointer(vcpu_guest_context_transparent_t *vc);
 int get_vcpu_context(int domid, int vcpu, vcpu_guest_context_transparent_t *vc);
+int get_vcpu_contexts(int domid, int nr_vcpus, const unsigned char *skip,
+		vcpu_guest_context_transparent_t *vcs, int *rets);
+/* vCPU state bits, see get_vcpu_states() */
+#define VCPU_ONLINE  (1 << 0)
+#define VCPU_BLOCKED (1 << 1)
+int get_vcpu_states(int domid, int nr_vcpus, unsigned char *states);
 void xen_map_domu_page(int domid, int vcpu, uint64_t addr, unsigned long *mfn, void **buf);
+void xen_unmap_domu_page(void *buf);
 int get_domain_state(int domid, unsigned int *state);
 int pause_domain(int domid);
 int unpause_domain(int domid);
 int get_max_vcpu_id(int domid);
+/* Store the ids of up to max existing domains, lowest first, in domids.
+ * Returns the number of ids stored, or a negative value on error. */
+int get_domain_list(int *domids, int max);
+
+/* Every hypercall and foreign mapping the backends make is counted and
+ * timed by type. Each thread keeps its own numbers, and adds them to the
+ * totals when it closes its handles. */
+typedef enum {
+	XEN_CALL_GETDOMAININFO,
+	XEN_CALL_GETDOMAININFOLIST,
+	XEN_CALL_GETVCPUCONTEXT,
+	XEN_CALL_GETVCPUINFO,
+	XEN_CALL_PAUSEDOMAIN,
+	XEN_CALL_UNPAUSEDOMAIN,
+	XEN_CALL_ADDRESS_SIZE,
+	XEN_CALL_MULTICALL,             // a batch of the domctls above
+	XEN_CALL_TRANSLATE,             // libxc's xc_translate_foreign_address()
+	XEN_CALL_MAP,
+	XEN_CALL_UNMAP,
+	XEN_CALL_NR_TYPES
+} xen_call_type_t;
+
+typedef struct {
+	unsigned long long count;
+	unsigned long long nsec;
+} xen_call_stats_t;
+
+const char *xen_call_name(xen_call_type_t type);
+/* the totals of all threads that have closed their handles */
+void xen_call_get_stats(xen_call_stats_t stats[XEN_CALL_NR_TYPES]);
+/* for the backends: account for call, which is of the given type, and return its result */
+#define XEN_CALL(type, call) ({					\
+	uint64_t __begin = sample_timer_now();			\
+	__typeof__(call) __ret = (call);			\
+	xen_call_end((type), __begin);				\
+	__ret;							\
+})
+void xen_call_end(xen_call_type_t type, uint64_t begin);
+
+#if defined(HYPERCALL_XENCALL)
+/* Per-domain translation cache for the libxencall backend, which has to walk
+ * the guest page tables itself. It caches virtual page -> mfn translations
+ * (including failed ones) keyed by page table root, keeps page table pages
+ * mapped between walks, and remembers the last vCPU context fetched with
+ * get_vcpu_context(), so translating does not need any hypercalls on a hit.
+ * Translations of the same domain from several threads are serialized by
+ * xlat_lock(). Fetching contexts must not overlap with translations. */
+struct xlat_domain;
+
+typedef struct {
+	unsigned long long hits;
+	unsigned long long negative_hits;
+	unsigned long long misses;
+	unsigned long long flushes;
+	unsigned long long table_hits;
+	unsigned long long table_misses;
+} xlat_stats_t;
+
+struct xlat_domain *xlat_domain(int domid);
+void xlat_lock(struct xlat_domain *d);
+void xlat_unlock(struct xlat_domain *d);
+void xlat_domain_release(int domid);
+int xlat_get_stats(int domid, xlat_stats_t *stats);
+vcpu_guest_context_t *xlat_vcpu_context(struct xlat_domain *d, int vcpu);
+int xlat_word_size(struct xlat_domain *d);
+int xlat_lookup(struct xlat_domain *d, uint64_t root, uint64_t virt, unsigned long *mfn);
+void xlat_insert(struct xlat_domain *d, uint64_t root, uint64_t virt, unsigned long mfn, int shift);
+void *xlat_map_table(struct xlat_domain *d, xen_pfn_t pfn);
+/* implemented per architecture: the page table root register of a context */
+uint64_t xlat_context_root(vcpu_guest_context_t *ctx);
+#endif /* HYPERCALL_XENCALL */
 
 #endif /* __XEN_INTERFACE_H */
@@ -0,0 +1,152 @@
+/*
+ * uniprof: per-phase timing of the sampling hot path
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <instrument.h>
+
+#ifdef WITH_INSTRUMENTATION
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <timer.h>
+
+static const char *phase_names[INSTR_NR_PHASES] = {
+	[INSTR_PAUSE] = "pause",
+	[INSTR_CONTEXTS] = "contexts",
+	[INSTR_WALK] = "walk",
+	[INSTR_MAP] = "map",
+	[INSTR_UNPAUSE] = "unpause",
+	[INSTR_OUTPUT] = "output",
+	[INSTR_SYMBOLS] = "symbols",
+};
+
+/* part of the phase before them, indented in the summary */
+static const bool phase_nested[INSTR_NR_PHASES] = {
+	[INSTR_MAP] = true,
+	[INSTR_SYMBOLS] = true,
+};
+
+static const char *counter_names[INSTR_NR_COUNTERS] = {
+	[INSTR_HYPERCALLS] = "hypercalls",
+	[INSTR_MAPPINGS] = "mappings",
+};
+
+/* the sample being taken; walker and unwind threads add to it as well */
+static atomic_ullong phase_nsec[INSTR_NR_PHASES];
+static atomic_ullong counts[INSTR_NR_COUNTERS];
+
+static latency_hist_t phase_hists[INSTR_NR_PHASES];
+static latency_hist_t counter_hists[INSTR_NR_COUNTERS];
+static unsigned long long phase_totals[INSTR_NR_PHASES];
+static FILE *csv;
+
+void instr_add(instr_phase_t phase, uint64_t nsecs)
+{
+	atomic_fetch_add_explicit(&phase_nsec[phase], nsecs, memory_order_relaxed);
+}
+
+void instr_count(instr_counter_t counter)
+{
+	atomic_fetch_add_explicit(&counts[counter], 1, memory_order_relaxed);
+}
+
+int instr_open_csv(const char *name)
+{
+	unsigned int i;
+
+	csv = fopen(name, "w");
+	if (!csv)
+		return -1;
+	fprintf(csv, "domid,timestamp");
+	for (i = 0; i < INSTR_NR_PHASES; i++)
+		fprintf(csv, ",%s_ns", phase_names[i]);
+	for (i = 0; i < INSTR_NR_COUNTERS; i++)
+		fprintf(csv, ",%s", counter_names[i]);
+	fprintf(csv, "\n");
+	return 0;
+}
+
+void instr_end_sample(int domid, uint64_t timestamp)
+{
+	unsigned long long val;
+	unsigned int i;
+
+	if (csv)
+		fprintf(csv, "%d,%"PRIu64, domid, timestamp);
+	for (i = 0; i < INSTR_NR_PHASES; i++) {
+		val = atomic_exchange_explicit(&phase_nsec[i], 0, memory_order_relaxed);
+		latency_hist_add(&phase_hists[i], val);
+		phase_totals[i] += val;
+		if (csv)
+			fprintf(csv, ",%llu", val);
+	}
+	for (i = 0; i < INSTR_NR_COUNTERS; i++) {
+		val = atomic_exchange_explicit(&counts[i], 0, memory_order_relaxed);
+		latency_hist_add(&counter_hists[i], val);
+		if (csv)
+			fprintf(csv, ",%llu", val);
+	}
+	if (csv)
+		fprintf(csv, "\n");
+}
+
+static void print_row(FILE *f, const char *name, const latency_hist_t *hist)
+{
+	fprintf(f, "%-12s %10llu %10llu %10llu %10llu %10llu\n", name,
+			latency_hist_percentile(hist, 50), latency_hist_percentile(hist, 90),
+			latency_hist_percentile(hist, 99), latency_hist_percentile(hist, 99.9), hist->max);
+}
+
+void instr_finish(FILE *f)
+{
+	unsigned int i;
+
+	if (csv)
+		fclose(csv);
+	csv = NULL;
+	if (!phase_hists[0].count)
+		return;
+	fprintf(f, "time per sample (ns) over %llu samples:\n", phase_hists[0].count);
+	fprintf(f, "%-12s %10s %10s %10s %10s %10s %10s\n", "phase", "p50", "p90", "p99", "p99.9", "max", "total ms");
+	for (i = 0; i < INSTR_NR_PHASES; i++) {
+		fprintf(f, "%s%-*s %10llu %10llu %10llu %10llu %10llu %10llu\n",
+				phase_nested[i] ? "  " : "", phase_nested[i] ? 10 : 12, phase_names[i],
+				latency_hist_percentile(&phase_hists[i], 50), latency_hist_percentile(&phase_hists[i], 90),
+				latency_hist_percentile(&phase_hists[i], 99), latency_hist_percentile(&phase_hists[i], 99.9),
+				phase_hists[i].max, phase_totals[i] / 1000000);
+	}
+	fprintf(f, "per sample:\n");
+	for (i = 0; i < INSTR_NR_COUNTERS; i++)
+		print_row(f, counter_names[i], &counter_hists[i]);
+}
+#endif /* WITH_INSTRUMENTATION */
@@ -0,0 +1,175 @@
+/*
+ * uniprof: bounded cache of mapped guest pages
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <page-cache.h>
+
+#define INDEX_EMPTY (-1)
+
+static inline unsigned int hash_slot(page_cache_t *pc, guest_word_t base)
+{
+	/* Fibonacci hashing on the page number. Consecutive stack pages
+	 * end up spread over the index instead of in one long probe run. */
+	return (unsigned int)(((base >> PAGE_SHIFT) * 0x9E3779B97F4A7C15ULL) >> 32) & pc->index_mask;
+}
+
+page_cache_t *page_cache_create(unsigned int capacity)
+{
+	page_cache_t *pc;
+	unsigned int slots = 2;
+	unsigned int i;
+
+	if (capacity == 0 || capacity > PAGE_CACHE_MAX_CAPACITY)
+		return NULL;
+	/* keep the load factor at or below 0.5 so probe runs stay short */
+	while (slots < 2 * capacity)
+		slots <<= 1;
+
+	pc = calloc(1, sizeof(page_cache_t));
+	if (!pc)
+		return NULL;
+	pc->capacity = capacity;
+	pc->index_mask = slots - 1;
+	pc->index = malloc(slots * sizeof(int32_t));
+	pc->entries = calloc(capacity, sizeof(page_cache_entry_t));
+	if (!pc->index || !pc->entries) {
+		free(pc->index);
+		free(pc->entries);
+		free(pc);
+		return NULL;
+	}
+	for (i = 0; i < slots; i++)
+		pc->index[i] = INDEX_EMPTY;
+	return pc;
+}
+
+void page_cache_destroy(page_cache_t *pc)
+{
+	unsigned int i;
+
+	if (!pc)
+		return;
+	for (i = 0; i < pc->used; i++)
+		xen_unmap_domu_page(pc->entries[i].buf);
+	free(pc->index);
+	free(pc->entries);
+	free(pc);
+}
+
+void *page_cache_lookup(page_cache_t *pc, guest_word_t base)
+{
+	unsigned int slot = hash_slot(pc, base);
+	page_cache_entry_t *e;
+
+	while (pc->index[slot] != INDEX_EMPTY) {
+		e = &pc->entries[pc->index[slot]];
+		if (e->base == base) {
+			e->referenced = 1;
+			pc->hits++;
+			return e->buf;
+		}
+		slot = (slot + 1) & pc->index_mask;
+	}
+	pc->misses++;
+	return NULL;
+}
+
+/* Remove the index slot pointing to entry number num. With linear probing,
+ * we can't just mark the slot as empty, since that would cut probe runs
+ * short for other keys. Instead, shift later members of the run back into
+ * the hole (backward shift deletion), which avoids tombstones altogether. */
+static void index_remove(page_cache_t *pc, unsigned int num)
+{
+	unsigned int hole = hash_slot(pc, pc->entries[num].base);
+	unsigned int next, home;
+
+	while (pc->index[hole] != (int32_t)num)
+		hole = (hole + 1) & pc->index_mask;
+
+	next = hole;
+	for (;;) {
+		next = (next + 1) & pc->index_mask;
+		if (pc->index[next] == INDEX_EMPTY)
+			break;
+		home = hash_slot(pc, pc->entries[pc->index[next]].base);
+		/* The entry in next can only move into the hole if its home
+		 * slot is not cyclically between the hole and next. */
+		if ((hole <= next) ? ((hole < home) && (home <= next))
+		                   : ((hole < home) || (home <= next)))
+			continue;
+		pc->index[hole] = pc->index[next];
+		hole = next;
+	}
+	pc->index[hole] = INDEX_EMPTY;
+}
+
+void page_cache_insert(page_cache_t *pc, guest_word_t base, unsigned long mfn, void *buf)
+{
+	unsigned int num, slot;
+	page_cache_entry_t *e;
+
+	if (pc->used < pc->capacity) {
+		num = pc->used++;
+	}
+	else {
+		/* CLOCK: sweep over the entries, giving every recently
+		 * referenced page a second chance, until we find one that
+		 * hasn't been touched since the hand last passed it. */
+		while (pc->entries[pc->hand].referenced) {
+			pc->entries[pc->hand].referenced = 0;
+			pc->hand = (pc->hand + 1) % pc->capacity;
+		}
+		num = pc->hand;
+		pc->hand = (pc->hand + 1) % pc->capacity;
+
+		e = &pc->entries[num];
+		DBG("evicting page %#"PRIx64"->%p\n", e->base, e->buf);
+		index_remove(pc, num);
+		xen_unmap_domu_page(e->buf);
+		pc->evictions++;
+	}
+
+	e = &pc->entries[num];
+	e->base = base;
+	e->mfn = mfn;
+	e->buf = buf;
+	e->referenced = 1;
+
+	slot = hash_slot(pc, base);
+	while (pc->index[slot] != INDEX_EMPTY)
+		slot = (slot + 1) & pc->index_mask;
+	pc->index[slot] = num;
+}
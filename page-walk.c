@@ -0,0 +1,181 @@
+/*
+ * uniprof: guest page table walkers
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+#include <page-walk.h>
+
+#define X86_PTE_PRESENT (1ULL<<0)
+#define X86_PTE_PS      (1ULL<<7)
+/* bits 51..12 hold the frame address */
+#define X86_PTE_ADDR    0x000FFFFFFFFFF000ULL
+
+unsigned long page_walk_x86(uint64_t table_pfn, int levels, uint64_t virt,
+		page_walk_map_fn map, void *opaque, int *page_shift)
+{
+	int i, shift;
+	uint64_t pte, offset, page_mask;
+	void *table;
+
+	/* See AMD64 Architecture Programmer's Manual, Volume 2: System Programming,
+	 * rev 3.22, p. 127, Fig. 5-9 for 32-bit and p, 132, Fig. 5-17 for 64-bit. */
+	for (i = levels; i > 0; i--) {
+		/* Each page table considers a 9-bit range. The lowest level
+		 * considers bits 12-20, each higher level the next-significant
+		 * 9 bits. For 32-bit, the highest level is truncated to 2 bits,
+		 * which works out since virt doesn't have any higher bits set.
+		 * PTEs are 8 bytes for both 64-bit and 32-bit (Xen doesn't
+		 * seem to emulate legacy non-PAE setups with 4-byte PTEs). */
+		shift = PAGE_WALK_SHIFT + 9 * (i - 1);
+		offset = ((virt >> shift) & 0x1ff) * 8;
+		table = map(opaque, table_pfn);
+		if (!table)
+			return 0;
+		memcpy(&pte, table + offset, 8);
+		if (!(pte & X86_PTE_PRESENT))
+			return 0;
+		/* PS=1 in a PDE maps a 2 MiB page, in a long mode PDPTE a 1 GiB
+		 * page. (In the PTE itself, bit 7 is PAT, and PAE PDPTEs don't
+		 * have it.) The frame address then only has bits 51..shift, and
+		 * virt supplies the rest. Note that this also masks out the PAT
+		 * bit, which large pages keep in bit 12. */
+		if ((i == 2 || (i == 3 && levels == 4)) && (pte & X86_PTE_PS)) {
+			page_mask = (1ULL << shift) - 1;
+			*page_shift = shift;
+			return ((pte & X86_PTE_ADDR & ~page_mask) | (virt & page_mask)) >> PAGE_WALK_SHIFT;
+		}
+		table_pfn = (pte & X86_PTE_ADDR) >> PAGE_WALK_SHIFT;
+	}
+	*page_shift = PAGE_WALK_SHIFT;
+	return table_pfn;
+}
+
+/* read a size-byte descriptor at physical address phys */
+static int read_descriptor(page_walk_map_fn map, void *opaque, uint64_t phys, void *desc, int size)
+{
+	void *table = map(opaque, phys >> PAGE_WALK_SHIFT);
+
+	if (!table)
+		return -1;
+	memcpy(desc, table + (phys & ((1ULL << PAGE_WALK_SHIFT) - 1)), size);
+	return 0;
+}
+
+/* bits 47..12 hold the next table or output address */
+#define ARM_DESC_ADDR   0x0000FFFFFFFFF000ULL
+#define ARM_DESC_TYPE   0x3ULL
+#define ARM_DESC_BLOCK  0x1ULL /* levels 1 and 2 */
+#define ARM_DESC_TABLE  0x3ULL /* levels 0 to 2; a page at level 3 */
+
+unsigned long page_walk_arm_long(uint64_t table_addr, int va_bits, uint64_t virt,
+		page_walk_map_fn map, void *opaque, int *page_shift)
+{
+	int level, shift, bits;
+	uint64_t desc, index, page_mask;
+
+	if (va_bits <= PAGE_WALK_SHIFT || va_bits > 48)
+		return 0;
+	/* See ARMv8 ARM, D4.2: each level resolves 9 bits of the address,
+	 * level 3 resolves bits 20..12. The initial level is the one whose
+	 * range contains the most significant address bit; it may resolve
+	 * fewer than 9 bits. */
+	level = 3 - (va_bits - PAGE_WALK_SHIFT - 1) / 9;
+	for (; level <= 3; level++) {
+		shift = PAGE_WALK_SHIFT + 9 * (3 - level);
+		bits = (va_bits - shift < 9) ? (va_bits - shift) : 9;
+		index = (virt >> shift) & ((1ULL << bits) - 1);
+		if (read_descriptor(map, opaque, table_addr + index * 8, &desc, 8))
+			return 0;
+		if (level == 3) {
+			if ((desc & ARM_DESC_TYPE) != ARM_DESC_TABLE)
+				return 0;
+			break;
+		}
+		if ((desc & ARM_DESC_TYPE) == ARM_DESC_BLOCK && level > 0) {
+			/* block descriptor: the output address has bits 47..shift,
+			 * virt supplies the rest */
+			page_mask = (1ULL << shift) - 1;
+			*page_shift = shift;
+			return ((desc & ARM_DESC_ADDR & ~page_mask) | (virt & page_mask)) >> PAGE_WALK_SHIFT;
+		}
+		if ((desc & ARM_DESC_TYPE) != ARM_DESC_TABLE)
+			return 0;
+		table_addr = desc & ARM_DESC_ADDR;
+	}
+	*page_shift = PAGE_WALK_SHIFT;
+	return (desc & ARM_DESC_ADDR) >> PAGE_WALK_SHIFT;
+}
+
+unsigned long page_walk_arm_short(uint64_t table_addr, uint32_t virt,
+		page_walk_map_fn map, void *opaque, int *page_shift)
+{
+	uint32_t desc;
+
+	/* See ARMv7 Reference Manual, Figures B3-9 to B3-11: the first-level
+	 * table index is virt[31..20] (with a split TTBR0 range, the upper bits
+	 * are 0 anyway), descriptors are 4 bytes each. */
+	if (read_descriptor(map, opaque, table_addr + ((virt >> 20) << 2), &desc, 4))
+		return 0;
+	switch (desc & 0x3) {
+		case 0x0:
+			/* translation fault */
+			return 0;
+		case 0x1:
+			/* Page table. The second-level table base (bits 31..10) is in
+			 * desc[31..10], the index (bits 9..2) is virt[19..12]. */
+			table_addr = (desc & 0xFFFFFC00) | (((virt >> 12) & 0xFF) << 2);
+			if (read_descriptor(map, opaque, table_addr, &desc, 4))
+				return 0;
+			if ((desc & 0x3) == 0x0)
+				return 0;
+			if ((desc & 0x3) == 0x1) {
+				/* large page: base is desc[31..16], offset virt[15..0] */
+				*page_shift = 16;
+				return ((desc & 0xFFFF0000) | (virt & 0xFFFF)) >> PAGE_WALK_SHIFT;
+			}
+			/* small page: base is desc[31..12] (bit 0 is XN) */
+			*page_shift = PAGE_WALK_SHIFT;
+			return (desc & 0xFFFFF000) >> PAGE_WALK_SHIFT;
+		default:
+			/* Section (bit 0 is PXN). Bit 18 marks a 16 MiB supersection
+			 * with base desc[31..24]; otherwise it's a 1 MiB section with
+			 * base desc[31..20]. Extended supersection address bits are
+			 * ignored. */
+			if (desc & (1 << 18)) {
+				*page_shift = 24;
+				return ((desc & 0xFF000000) | (virt & 0x00FFFFFF)) >> PAGE_WALK_SHIFT;
+			}
+			*page_shift = 20;
+			return ((desc & 0xFFF00000) | (virt & 0x000FFFFF)) >> PAGE_WALK_SHIFT;
+	}
+}
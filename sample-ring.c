@@ -0,0 +1,107 @@
+/*
+ * uniprof: single-producer single-consumer ring of fixed-size slots
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <sample-ring.h>
+
+sample_ring_t *sample_ring_create(unsigned int nr_slots, size_t slot_size)
+{
+	sample_ring_t *ring;
+	unsigned int n = 1;
+
+	if (nr_slots == 0)
+		return NULL;
+	while (n < nr_slots)
+		n <<= 1;
+	ring = malloc(sizeof(sample_ring_t));
+	if (!ring)
+		return NULL;
+	ring->slots = calloc(n, slot_size);
+	if (!ring->slots) {
+		free(ring);
+		return NULL;
+	}
+	ring->nr_slots = n;
+	ring->slot_size = slot_size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return ring;
+}
+
+void sample_ring_destroy(sample_ring_t *ring)
+{
+	if (!ring)
+		return;
+	free(ring->slots);
+	free(ring);
+}
+
+void *sample_ring_slot(sample_ring_t *ring, unsigned int i)
+{
+	return ring->slots + (size_t)(i & (ring->nr_slots - 1)) * ring->slot_size;
+}
+
+void *sample_ring_reserve(sample_ring_t *ring)
+{
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	/* acquire: the consumer must be done with the slot before we reuse it */
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail == ring->nr_slots)
+		return NULL;
+	return sample_ring_slot(ring, head);
+}
+
+void sample_ring_publish(sample_ring_t *ring)
+{
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	/* release: the slot contents must be visible before the new head */
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void *sample_ring_peek(sample_ring_t *ring)
+{
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+	return sample_ring_slot(ring, tail);
+}
+
+void sample_ring_release(sample_ring_t *ring)
+{
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,172 @@
+/*
+ * uniprof: aggregation of identical stack traces
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stack-agg.h>
+
+#define STACK_AGG_INITIAL_CAPACITY 1024
+#define STACK_AGG_INITIAL_FRAMES 16384
+
+/* FNV-1a over the frame words */
+static uint64_t hash_stack(const uint64_t *frames, unsigned int nr_frames, bool complete)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ complete;
+	unsigned int i;
+
+	for (i = 0; i < nr_frames; i++) {
+		h ^= frames[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static size_t slot_of(stack_agg_t *agg, uint64_t hash)
+{
+	// Fibonacci hashing spreads the high bits of the hash over the table
+	return (hash * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzl(agg->capacity));
+}
+
+static int grow_table(stack_agg_t *agg)
+{
+	stack_agg_entry_t *old = agg->entries;
+	size_t old_capacity = agg->capacity;
+	size_t i, slot;
+
+	agg->entries = calloc(old_capacity * 2, sizeof(stack_agg_entry_t));
+	if (!agg->entries) {
+		agg->entries = old;
+		return -1;
+	}
+	agg->capacity = old_capacity * 2;
+	for (i = 0; i < old_capacity; i++) {
+		if (!old[i].count)
+			continue;
+		slot = slot_of(agg, old[i].hash);
+		while (agg->entries[slot].count)
+			slot = (slot + 1) & (agg->capacity - 1);
+		agg->entries[slot] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+stack_agg_t *stack_agg_create(void)
+{
+	stack_agg_t *agg;
+
+	agg = calloc(1, sizeof(stack_agg_t));
+	if (!agg)
+		return NULL;
+	agg->capacity = STACK_AGG_INITIAL_CAPACITY;
+	agg->entries = calloc(agg->capacity, sizeof(stack_agg_entry_t));
+	agg->frames_size = STACK_AGG_INITIAL_FRAMES;
+	agg->frames = malloc(agg->frames_size * sizeof(uint64_t));
+	if (!agg->entries || !agg->frames) {
+		stack_agg_destroy(agg);
+		return NULL;
+	}
+	return agg;
+}
+
+void stack_agg_destroy(stack_agg_t *agg)
+{
+	if (!agg)
+		return;
+	free(agg->entries);
+	free(agg->frames);
+	free(agg);
+}
+
+int stack_agg_add(stack_agg_t *agg, const uint64_t *frames, unsigned int nr_frames, bool complete)
+{
+	uint64_t hash = hash_stack(frames, nr_frames, complete);
+	stack_agg_entry_t *e;
+	uint64_t *new_frames;
+	size_t slot, size;
+
+	slot = slot_of(agg, hash);
+	while (agg->entries[slot].count) {
+		e = &agg->entries[slot];
+		if (e->hash == hash && e->nr_frames == nr_frames && e->complete == complete &&
+				!memcmp(agg->frames + e->frames, frames, nr_frames * sizeof(uint64_t))) {
+			e->count++;
+			agg->samples++;
+			return 0;
+		}
+		slot = (slot + 1) & (agg->capacity - 1);
+	}
+
+	// a new stack: store its frames, then claim the free slot we found.
+	// Never fill the last slot, or lookups would not terminate.
+	if (agg->used + 1 == agg->capacity)
+		return -1;
+	if (agg->nr_frames + nr_frames > agg->frames_size) {
+		size = agg->frames_size;
+		while (agg->nr_frames + nr_frames > size)
+			size *= 2;
+		new_frames = realloc(agg->frames, size * sizeof(uint64_t));
+		if (!new_frames)
+			return -1;
+		agg->frames = new_frames;
+		agg->frames_size = size;
+	}
+	e = &agg->entries[slot];
+	e->hash = hash;
+	e->count = 1;
+	e->frames = agg->nr_frames;
+	e->nr_frames = nr_frames;
+	e->complete = complete;
+	memcpy(agg->frames + agg->nr_frames, frames, nr_frames * sizeof(uint64_t));
+	agg->nr_frames += nr_frames;
+	agg->used++;
+	agg->samples++;
+
+	// keep the load factor below 3/4 so probe sequences stay short
+	if (agg->used * 4 > agg->capacity * 3)
+		grow_table(agg);
+	return 0;
+}
+
+void stack_agg_foreach(stack_agg_t *agg, stack_agg_fn fn, void *opaque)
+{
+	size_t i;
+	stack_agg_entry_t *e;
+
+	for (i = 0; i < agg->capacity; i++) {
+		e = &agg->entries[i];
+		if (e->count)
+			fn(opaque, agg->frames + e->frames, e->nr_frames, e->complete, e->count);
+	}
+}
@@ -0,0 +1,1037 @@
+/*
+ * uniprof: cache-friendly index of symbols by address
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <ctype.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <symbol-index.h>
+
+/* eight keys to a cache line: prefetching node 8k fetches all of k's
+ * descendants three levels down */
+#define SYMBOL_INDEX_LINE_KEYS 8
+/* searches interleaved by symbol_index_lookup_batch() */
+#define SYMBOL_INDEX_BATCH     16
+/* the padded tree has to stay addressable with an unsigned int */
+#define SYMBOL_INDEX_MAX       (1U << 30)
+
+symbol_index_t *symbol_index_create(unsigned int num)
+{
+	symbol_index_t *idx;
+
+	if (num >= SYMBOL_INDEX_MAX)
+		return NULL;
+	if (num == 0)
+		num = 1024;
+	idx = calloc(1, sizeof(symbol_index_t));
+	if (!idx)
+		return NULL;
+	idx->sorted = malloc(num * sizeof(symbol_t));
+	idx->strings_size = 16 * num;
+	idx->strings = malloc(idx->strings_size);
+	idx->interned_mask = 1024 - 1;
+	idx->interned = calloc(idx->interned_mask + 1, sizeof(uint32_t));
+	if (!idx->sorted || !idx->strings || !idx->interned) {
+		symbol_index_destroy(idx);
+		return NULL;
+	}
+	idx->num = num;
+	idx->text_start = UINT64_MAX;
+	// offset 0 is the empty string, which also marks padding
+	idx->strings[0] = '\0';
+	idx->strings_len = 1;
+	return idx;
+}
+
+void symbol_index_destroy(symbol_index_t *idx)
+{
+	if (!idx)
+		return;
+	if (idx->map) {
+		// keys, slots, and strings all point into the cache file
+		munmap(idx->map, idx->map_size);
+		free(idx);
+		return;
+	}
+	free(idx->interned);
+	free(idx->strings);
+	free(idx->sorted);
+	free(idx->slots);
+	free(idx->keys);
+	free(idx);
+}
+
+/* FNV-1a */
+static uint64_t symbol_name_hash(const char *name, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static int symbol_intern_grow(symbol_index_t *idx)
+{
+	size_t mask = 2 * idx->interned_mask + 1;
+	uint32_t *interned, off;
+	size_t i, slot;
+
+	interned = calloc(mask + 1, sizeof(uint32_t));
+	if (!interned)
+		return -ENOMEM;
+	for (i = 0; i <= idx->interned_mask; i++) {
+		off = idx->interned[i];
+		if (!off)
+			continue;
+		slot = symbol_name_hash(idx->strings + off, strlen(idx->strings + off)) & mask;
+		while (interned[slot])
+			slot = (slot + 1) & mask;
+		interned[slot] = off;
+	}
+	free(idx->interned);
+	idx->interned = interned;
+	idx->interned_mask = mask;
+	return 0;
+}
+
+/* Return the arena offset of the len (> 0) characters at name, copying
+ * them into the arena if we haven't seen that name before, or 0 on failure. */
+static uint32_t symbol_intern(symbol_index_t *idx, const char *name, size_t len)
+{
+	size_t slot, size;
+	uint32_t off;
+	char *strings;
+
+	// keep the table at most half full
+	if (2 * (idx->nr_interned + 1) > idx->interned_mask + 1 && symbol_intern_grow(idx))
+		return 0;
+	slot = symbol_name_hash(name, len) & idx->interned_mask;
+	while ((off = idx->interned[slot]) != 0) {
+		if (!memcmp(idx->strings + off, name, len) && idx->strings[off + len] == '\0')
+			return off;
+		slot = (slot + 1) & idx->interned_mask;
+	}
+
+	if (idx->strings_len + len + 1 > UINT32_MAX)
+		return 0;
+	if (idx->strings_len + len + 1 > idx->strings_size) {
+		size = 2 * idx->strings_size;
+		while (idx->strings_len + len + 1 > size)
+			size *= 2;
+		strings = realloc(idx->strings, size);
+		if (!strings)
+			return 0;
+		idx->strings = strings;
+		idx->strings_size = size;
+	}
+	off = idx->strings_len;
+	memcpy(idx->strings + off, name, len);
+	idx->strings[off + len] = '\0';
+	idx->strings_len += len + 1;
+	idx->interned[slot] = off;
+	idx->nr_interned++;
+	return off;
+}
+
+int symbol_index_add(symbol_index_t *idx, uint64_t addr, uint64_t size, const char *name, size_t len)
+{
+	symbol_t *sorted;
+	uint32_t off;
+
+	if (!idx->sorted)
+		return -ENOMEM;
+	if (len == 0)
+		return -EINVAL;
+	if (idx->filled == idx->num) {
+		if (2 * idx->num >= SYMBOL_INDEX_MAX)
+			return -ENOMEM;
+		sorted = realloc(idx->sorted, 2 * idx->num * sizeof(symbol_t));
+		if (!sorted)
+			return -ENOMEM;
+		idx->sorted = sorted;
+		idx->num *= 2;
+	}
+	off = symbol_intern(idx, name, len);
+	if (!off)
+		return -ENOMEM;
+	idx->sorted[idx->filled].addr = addr;
+	idx->sorted[idx->filled].name = off;
+	// a size we can't store is as good as an unknown one
+	idx->sorted[idx->filled].size = size <= UINT32_MAX ? size : 0;
+	idx->filled++;
+	return 0;
+}
+
+void symbol_index_add_text(symbol_index_t *idx, uint64_t addr, uint64_t size)
+{
+	// text_start is UINT64_MAX until the first text symbol comes along
+	if (idx->text_start == UINT64_MAX || addr > idx->text_end) {
+		idx->text_end = addr;
+		idx->text_last_size = size;
+	} else if (addr == idx->text_end && size > idx->text_last_size) {
+		idx->text_last_size = size;
+	}
+	if (addr < idx->text_start)
+		idx->text_start = addr;
+}
+
+/**
+ * Sort n symbols by address. This is a (bottom-up) merge sort, because it
+ * has to be stable: of several symbols at the same address, the last one
+ * added ends up last, just as in input that is sorted already.
+ */
+static int symbol_sort(symbol_t *syms, unsigned int n)
+{
+	symbol_t *tmp, *src, *dst, *swap;
+	unsigned int width, lo, mid, hi, i, j, k;
+
+	tmp = malloc(n * sizeof(symbol_t));
+	if (!tmp)
+		return -ENOMEM;
+	src = syms;
+	dst = tmp;
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			mid = lo + width < n ? lo + width : n;
+			hi = lo + 2 * width < n ? lo + 2 * width : n;
+			i = lo;
+			j = mid;
+			k = lo;
+			while (i < mid && j < hi)
+				dst[k++] = src[j].addr < src[i].addr ? src[j++] : src[i++];
+			while (i < mid)
+				dst[k++] = src[i++];
+			while (j < hi)
+				dst[k++] = src[j++];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != syms)
+		memcpy(syms, src, n * sizeof(symbol_t));
+	free(tmp);
+	return 0;
+}
+
+/* Store the sorted symbols, starting with the i-th, in the subtree rooted
+ * at slot k, in order. Returns the number of the next symbol to store. */
+static unsigned int symbol_index_place(symbol_index_t *idx, unsigned int i, unsigned int k)
+{
+	if (k > idx->size)
+		return i;
+	i = symbol_index_place(idx, i, 2 * k);
+	if (i < idx->filled) {
+		idx->slots[k] = idx->sorted[i];
+		if (i == idx->filled - 1)
+			idx->last_slot = k;
+	} else {
+		// padding sorts after everything, so lookups never end up here
+		idx->slots[k].addr = UINT64_MAX;
+		idx->slots[k].name = 0;
+		idx->slots[k].size = 0;
+	}
+	idx->keys[k] = idx->slots[k].addr;
+	return symbol_index_place(idx, i + 1, 2 * k + 1);
+}
+
+/**
+ * Turn what symbol_index_add_text() saw into the range of code. If we
+ * don't know how long the highest text symbol is, it reaches up to the
+ * next symbol, just like in a lookup, or without one, to the end of the
+ * address space.
+ */
+static void symbol_text_range(symbol_index_t *idx)
+{
+	unsigned int lo = 0, hi = idx->filled, mid;
+
+	if (idx->text_start == UINT64_MAX) {
+		// no types to go by, so everything counts
+		idx->text_start = idx->first;
+		idx->text_end = idx->last;
+		idx->text_last_size = idx->slots[idx->last_slot].size;
+	}
+	if (idx->text_last_size) {
+		idx->text_end += idx->text_last_size;
+		return;
+	}
+	// the first symbol above text_end
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->sorted[mid].addr <= idx->text_end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	idx->text_end = lo < idx->filled ? idx->sorted[lo].addr : UINT64_MAX;
+}
+
+int symbol_index_build(symbol_index_t *idx)
+{
+	bool sorted = true;
+	unsigned int i, j;
+	void *keys;
+
+	if (!idx->sorted || idx->filled == 0)
+		return -EINVAL;
+	// nm -n output is sorted already, don't pay for sorting it again
+	for (i = 1; i < idx->filled && sorted; i++)
+		sorted = idx->sorted[i - 1].addr <= idx->sorted[i].addr;
+	if (!sorted) {
+		if (symbol_sort(idx->sorted, idx->filled))
+			return -ENOMEM;
+		// keep the last of each run of symbols at the same address
+		for (i = 0, j = 0; i < idx->filled; i++)
+			if (i + 1 == idx->filled || idx->sorted[i + 1].addr != idx->sorted[i].addr)
+				idx->sorted[j++] = idx->sorted[i];
+		idx->filled = j;
+	}
+
+	idx->levels = 0;
+	while ((1U << idx->levels) - 1 < idx->filled)
+		idx->levels++;
+	idx->size = (1U << idx->levels) - 1;
+	if (posix_memalign(&keys, SYMBOL_INDEX_LINE_KEYS * sizeof(uint64_t),
+			(idx->size + 1) * sizeof(uint64_t)))
+		return -ENOMEM;
+	idx->keys = keys;
+	idx->slots = malloc((idx->size + 1) * sizeof(symbol_t));
+	if (!idx->slots) {
+		free(idx->keys);
+		idx->keys = NULL;
+		return -ENOMEM;
+	}
+	symbol_index_place(idx, 0, 1);
+	idx->first = idx->sorted[0].addr;
+	idx->last = idx->sorted[idx->filled - 1].addr;
+	symbol_text_range(idx);
+	free(idx->sorted);
+	idx->sorted = NULL;
+	// names are only looked up by address from now on
+	free(idx->interned);
+	idx->interned = NULL;
+	return 0;
+}
+
+/**
+ * Parse one line of nm output, from p up to (not including) eol, into the
+ * address and the name of the symbol. Returns 0 on success, or -1 if the
+ * line doesn't describe a symbol with an address.
+ */
+static int nm_parse_line(const char *p, const char *eol, uint64_t *addr,
+		char *type, const char **name, size_t *len)
+{
+	const char *digits, *end;
+
+	while (p < eol && isblank((unsigned char)*p))
+		p++;
+	*addr = 0;
+	for (digits = p; p < eol && isxdigit((unsigned char)*p); p++) {
+		if (isdigit((unsigned char)*p))
+			*addr = *addr << 4 | (*p - '0');
+		else
+			*addr = *addr << 4 | (tolower((unsigned char)*p) - 'a' + 10);
+	}
+	if (p == digits || p - digits > 16 || p == eol || !isblank((unsigned char)*p))
+		return -1;
+	// then the type, a single character
+	while (p < eol && isblank((unsigned char)*p))
+		p++;
+	if (p == eol)
+		return -1;
+	*type = *p;
+	if (++p == eol || !isblank((unsigned char)*p))
+		return -1;
+	while (p < eol && isblank((unsigned char)*p))
+		p++;
+	// the name is the rest of the line, e.g. including a kallsyms [module]
+	end = eol;
+	while (end > p && isspace((unsigned char)end[-1]))
+		end--;
+	if (end == p)
+		return -1;
+	*name = p;
+	*len = end - p;
+	return 0;
+}
+
+/* Read all of fd, for files we cannot map, such as /proc/kallsyms. */
+static char *read_all(int fd, size_t *size)
+{
+	size_t len = 0, cap = 1 << 20;
+	char *buf, *nbuf;
+	ssize_t ret;
+
+	buf = malloc(cap);
+	if (!buf)
+		return NULL;
+	for (;;) {
+		if (len == cap) {
+			nbuf = realloc(buf, 2 * cap);
+			if (!nbuf)
+				goto err;
+			buf = nbuf;
+			cap *= 2;
+		}
+		ret = read(fd, buf + len, cap - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			goto err;
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	*size = len;
+	return buf;
+
+err:
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Map the file name, or read it if it cannot be mapped. On success, *data
+ * and *size describe its contents, which have to be released with
+ * symbol_file_release(). Returns 0 on success, or a negative errno value.
+ */
+static int symbol_file_load(const char *name, char **data, size_t *size, bool *mapped)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	*data = NULL;
+	*size = 0;
+	*mapped = false;
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	// procfs files claim to be empty, those we have to read the slow way
+	*size = st.st_size;
+	if (S_ISREG(st.st_mode) && *size > 0) {
+		*data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (*data == MAP_FAILED)
+			*data = NULL;
+		else
+			*mapped = true;
+	}
+	if (!*data)
+		*data = read_all(fd, size);
+	if (!*data)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static void symbol_file_release(char *data, size_t size, bool mapped)
+{
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+}
+
+static int nm_parse(symbol_index_t *idx, const char *data, size_t size)
+{
+	const char *p, *end, *eol, *sym;
+	uint64_t addr;
+	size_t len;
+	char type;
+	int count = 0;
+
+	for (p = data, end = data + size; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		if (nm_parse_line(p, eol, &addr, &type, &sym, &len))
+			continue;
+		if (symbol_index_add(idx, addr, 0, sym, len))
+			return -ENOMEM;
+		// code, or weak symbols, which are mostly functions
+		if (type && strchr("tTwW", type))
+			symbol_index_add_text(idx, addr, 0);
+		count++;
+	}
+	return count;
+}
+
+/* an ELF file in memory, and whether its byte order differs from ours */
+typedef struct {
+	const unsigned char *data;
+	size_t size;
+	bool is64;
+	bool swap;
+} elf_image_t;
+
+/* the fields of a section header we need, in our byte order */
+typedef struct {
+	uint32_t type;
+	uint32_t link;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t entsize;
+} elf_section_t;
+
+static uint16_t elf_half(const elf_image_t *elf, uint16_t v)
+{
+	return elf->swap ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t elf_word(const elf_image_t *elf, uint32_t v)
+{
+	return elf->swap ? __builtin_bswap32(v) : v;
+}
+
+static uint64_t elf_xword(const elf_image_t *elf, uint64_t v)
+{
+	return elf->swap ? __builtin_bswap64(v) : v;
+}
+
+/* whether size bytes at off lie within the file */
+static bool elf_contains(const elf_image_t *elf, uint64_t off, uint64_t size)
+{
+	return off <= elf->size && size <= elf->size - off;
+}
+
+/* Read section header i. Returns 0 on success, -EINVAL if it is broken. */
+static int elf_section(const elf_image_t *elf, uint64_t shoff, uint16_t shentsize,
+		unsigned int i, elf_section_t *sec)
+{
+	uint64_t off = shoff + (uint64_t)i * shentsize;
+	Elf64_Shdr sh64;
+	Elf32_Shdr sh32;
+
+	if (elf->is64) {
+		if (shentsize < sizeof(sh64) || !elf_contains(elf, off, sizeof(sh64)))
+			return -EINVAL;
+		memcpy(&sh64, elf->data + off, sizeof(sh64));
+		sec->type = elf_word(elf, sh64.sh_type);
+		sec->link = elf_word(elf, sh64.sh_link);
+		sec->offset = elf_xword(elf, sh64.sh_offset);
+		sec->size = elf_xword(elf, sh64.sh_size);
+		sec->entsize = elf_xword(elf, sh64.sh_entsize);
+	} else {
+		if (shentsize < sizeof(sh32) || !elf_contains(elf, off, sizeof(sh32)))
+			return -EINVAL;
+		memcpy(&sh32, elf->data + off, sizeof(sh32));
+		sec->type = elf_word(elf, sh32.sh_type);
+		sec->link = elf_word(elf, sh32.sh_link);
+		sec->offset = elf_word(elf, sh32.sh_offset);
+		sec->size = elf_word(elf, sh32.sh_size);
+		sec->entsize = elf_word(elf, sh32.sh_entsize);
+	}
+	if (sec->type != SHT_NOBITS && !elf_contains(elf, sec->offset, sec->size))
+		return -EINVAL;
+	return 0;
+}
+
+/* Add the function symbols in symtab, whose names are in strtab. */
+static int elf_add_symbols(symbol_index_t *idx, const elf_image_t *elf, uint16_t machine,
+		const elf_section_t *symtab, const elf_section_t *strtab)
+{
+	const char *strings = (const char *)elf->data + strtab->offset;
+	uint64_t i, nr, value, size;
+	uint32_t name;
+	uint16_t shndx;
+	unsigned char info;
+	Elf64_Sym sym64;
+	Elf32_Sym sym32;
+	size_t len;
+	int count = 0;
+
+	if (symtab->entsize < (elf->is64 ? sizeof(sym64) : sizeof(sym32)))
+		return -EINVAL;
+	nr = symtab->size / symtab->entsize;
+	// the first entry is always the undefined symbol
+	for (i = 1; i < nr; i++) {
+		if (elf->is64) {
+			memcpy(&sym64, elf->data + symtab->offset + i * symtab->entsize, sizeof(sym64));
+			name = elf_word(elf, sym64.st_name);
+			info = sym64.st_info;
+			shndx = elf_half(elf, sym64.st_shndx);
+			value = elf_xword(elf, sym64.st_value);
+			size = elf_xword(elf, sym64.st_size);
+		} else {
+			memcpy(&sym32, elf->data + symtab->offset + i * symtab->entsize, sizeof(sym32));
+			name = elf_word(elf, sym32.st_name);
+			info = sym32.st_info;
+			shndx = elf_half(elf, sym32.st_shndx);
+			value = elf_word(elf, sym32.st_value);
+			size = elf_word(elf, sym32.st_size);
+		}
+		// ELF32_ST_TYPE and ELF64_ST_TYPE are the same
+		if (ELF64_ST_TYPE(info) != STT_FUNC && ELF64_ST_TYPE(info) != STT_GNU_IFUNC)
+			continue;
+		if (shndx == SHN_UNDEF || name >= strtab->size)
+			continue;
+		len = strnlen(strings + name, strtab->size - name);
+		if (len == 0)
+			continue;
+		// on 32-bit ARM, bit 0 marks Thumb code, it isn't part of the address
+		if (machine == EM_ARM)
+			value &= ~1ULL;
+		if (symbol_index_add(idx, value, size, strings + name, len))
+			return -ENOMEM;
+		symbol_index_add_text(idx, value, size);
+		count++;
+	}
+	return count;
+}
+
+static int elf_parse(symbol_index_t *idx, const char *data, size_t size)
+{
+	elf_image_t elf = { (const unsigned char *)data, size, false, false };
+	elf_section_t sec, symtab = { 0 }, strtab;
+	bool have_symtab = false, have_dynsym = false;
+	uint16_t shentsize, machine;
+	unsigned int shnum, i;
+	uint64_t shoff;
+	Elf64_Ehdr eh64;
+	Elf32_Ehdr eh32;
+	int ret;
+
+	if (size < EI_NIDENT || memcmp(data, ELFMAG, SELFMAG))
+		return -ENOEXEC;
+	if (data[EI_CLASS] == ELFCLASS64)
+		elf.is64 = true;
+	else if (data[EI_CLASS] != ELFCLASS32)
+		return -ENOEXEC;
+	if (data[EI_DATA] == ELFDATA2LSB)
+		elf.swap = __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__;
+	else if (data[EI_DATA] == ELFDATA2MSB)
+		elf.swap = __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__;
+	else
+		return -ENOEXEC;
+
+	if (elf.is64) {
+		if (size < sizeof(eh64))
+			return -EINVAL;
+		memcpy(&eh64, data, sizeof(eh64));
+		machine = elf_half(&elf, eh64.e_machine);
+		shoff = elf_xword(&elf, eh64.e_shoff);
+		shentsize = elf_half(&elf, eh64.e_shentsize);
+		shnum = elf_half(&elf, eh64.e_shnum);
+	} else {
+		if (size < sizeof(eh32))
+			return -EINVAL;
+		memcpy(&eh32, data, sizeof(eh32));
+		machine = elf_half(&elf, eh32.e_machine);
+		shoff = elf_word(&elf, eh32.e_shoff);
+		shentsize = elf_half(&elf, eh32.e_shentsize);
+		shnum = elf_half(&elf, eh32.e_shnum);
+	}
+	// without section headers, there are no symbol tables either
+	if (shoff == 0)
+		return 0;
+	// with more than SHN_LORESERVE sections, the first one has the number
+	if (shnum == 0) {
+		ret = elf_section(&elf, shoff, shentsize, 0, &sec);
+		if (ret)
+			return ret;
+		shnum = sec.size;
+	}
+
+	// .symtab has everything, .dynsym only what's exported
+	for (i = 0; i < shnum && !have_symtab; i++) {
+		ret = elf_section(&elf, shoff, shentsize, i, &sec);
+		if (ret)
+			return ret;
+		if (sec.type == SHT_SYMTAB || (sec.type == SHT_DYNSYM && !have_dynsym)) {
+			symtab = sec;
+			have_symtab = sec.type == SHT_SYMTAB;
+			have_dynsym = true;
+		}
+	}
+	if (!have_dynsym)
+		return 0;
+	if (symtab.link >= shnum)
+		return -EINVAL;
+	ret = elf_section(&elf, shoff, shentsize, symtab.link, &strtab);
+	if (ret)
+		return ret;
+	if (strtab.type != SHT_STRTAB)
+		return -EINVAL;
+	return elf_add_symbols(idx, &elf, machine, &symtab, &strtab);
+}
+
+/* add the symbols in data, which is either an ELF file or nm output */
+static int symbol_parse(symbol_index_t *idx, char *data, size_t size, bool mapped)
+{
+	int ret;
+
+	ret = elf_parse(idx, data, size);
+	if (ret == -ENOEXEC) {
+		if (mapped)
+			madvise(data, size, MADV_SEQUENTIAL);
+		ret = nm_parse(idx, data, size);
+	}
+	return ret;
+}
+
+int symbol_index_read(symbol_index_t *idx, const char *name)
+{
+	bool mapped;
+	size_t size;
+	char *data;
+	int ret;
+
+	ret = symbol_file_load(name, &data, &size, &mapped);
+	if (ret)
+		return ret;
+	ret = symbol_parse(idx, data, size, mapped);
+	symbol_file_release(data, size, mapped);
+	return ret;
+}
+
+/**
+ * A cache file holds a built index just as it is in memory: this header,
+ * then the keys (at a cache line boundary), the slots, and the strings, in
+ * our byte order. The header also describes the source file it was made
+ * from, so we notice when that changes.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;       /* in our byte order, so it also checks that */
+	uint32_t levels;
+	uint32_t size;
+	uint32_t filled;
+	uint32_t last_slot;
+	uint32_t reserved;
+	uint64_t first;
+	uint64_t last;
+	uint64_t text_start;
+	uint64_t text_end;
+	uint64_t strings_len;
+	uint64_t source_size;
+	uint64_t source_mtime;  /* in ns */
+	uint64_t source_checksum;
+} symbol_cache_header_t;
+
+#define SYMBOL_CACHE_MAGIC   "UPSYMIDX"
+#define SYMBOL_CACHE_VERSION 2
+#define SYMBOL_CACHE_SUFFIX  ".symidx"
+#define SYMBOL_CACHE_KEYS    (SYMBOL_INDEX_LINE_KEYS * sizeof(uint64_t))
+
+static uint64_t stat_mtime(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* A quick checksum of data, eight bytes at a time. It only has to tell
+ * whether a file changed, so it need not be cryptographically strong. */
+static uint64_t symbol_checksum(const char *data, size_t size)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ size, word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = ((hash << 27 | hash >> 37) ^ word) * 0x100000001b3ULL;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static size_t symbol_cache_keys_offset(void)
+{
+	return (sizeof(symbol_cache_header_t) + SYMBOL_CACHE_KEYS - 1) & ~(SYMBOL_CACHE_KEYS - 1);
+}
+
+/**
+ * Map the cache file path, if it holds an index of a source file like st,
+ * with the same size, and either the same modification time, or, if
+ * checksum isn't NULL, the same checksum. Returns NULL otherwise.
+ */
+static symbol_index_t *symbol_cache_map(const char *path, const struct stat *st,
+		const uint64_t *checksum)
+{
+	symbol_cache_header_t *h;
+	symbol_index_t *idx;
+	struct stat cst;
+	size_t slots_off, strings_off;
+	uint64_t *keys;
+	symbol_t *slots;
+	unsigned int k;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &cst) || (size_t)cst.st_size < symbol_cache_keys_offset()) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	h = map;
+	if (memcmp(h->magic, SYMBOL_CACHE_MAGIC, sizeof(h->magic)) ||
+			h->version != SYMBOL_CACHE_VERSION ||
+			h->source_size != (uint64_t)st->st_size ||
+			(checksum ? h->source_checksum != *checksum : h->source_mtime != stat_mtime(st)))
+		goto out_unmap;
+	// don't trust the sizes in the header beyond what the file can hold
+	if (h->levels == 0 || h->levels > 30 || h->size != (1U << h->levels) - 1 ||
+			h->filled == 0 || h->filled > h->size || h->last_slot == 0 || h->last_slot > h->size)
+		goto out_unmap;
+	slots_off = symbol_cache_keys_offset() + (h->size + 1) * sizeof(uint64_t);
+	strings_off = slots_off + (h->size + 1) * sizeof(symbol_t);
+	if (h->strings_len == 0 || strings_off + h->strings_len != (uint64_t)cst.st_size ||
+			((char *)map)[cst.st_size - 1] != '\0')
+		goto out_unmap;
+
+	// nor the index itself: a lookup must not take us outside the file
+	keys = (uint64_t *)((char *)map + symbol_cache_keys_offset());
+	slots = (symbol_t *)((char *)map + slots_off);
+	for (k = 1; k <= h->size; k++)
+		if (keys[k] != slots[k].addr || slots[k].name >= h->strings_len)
+			goto out_unmap;
+	if (slots[h->last_slot].addr != h->last)
+		goto out_unmap;
+
+	idx = calloc(1, sizeof(symbol_index_t));
+	if (!idx)
+		goto out_unmap;
+	idx->num = h->filled;
+	idx->filled = h->filled;
+	idx->levels = h->levels;
+	idx->size = h->size;
+	idx->keys = keys;
+	idx->slots = slots;
+	idx->strings = (char *)map + strings_off;
+	idx->strings_len = h->strings_len;
+	idx->strings_size = h->strings_len;
+	idx->first = h->first;
+	idx->last = h->last;
+	idx->last_slot = h->last_slot;
+	idx->text_start = h->text_start;
+	idx->text_end = h->text_end;
+	idx->map = map;
+	idx->map_size = cst.st_size;
+	return idx;
+
+out_unmap:
+	munmap(map, cst.st_size);
+	return NULL;
+}
+
+/**
+ * Write the built index idx to the cache file path, for a source file like
+ * st with the given checksum. The file is replaced atomically, so other
+ * processes never map half of it. Returns 0 on success, -1 otherwise.
+ */
+static int symbol_cache_write(const char *path, const symbol_index_t *idx,
+		const struct stat *st, uint64_t checksum)
+{
+	static const char zeroes[SYMBOL_CACHE_KEYS];
+	symbol_cache_header_t h;
+	char *tmp;
+	FILE *f;
+	int ret = -1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SYMBOL_CACHE_MAGIC, sizeof(h.magic));
+	h.version = SYMBOL_CACHE_VERSION;
+	h.levels = idx->levels;
+	h.size = idx->size;
+	h.filled = idx->filled;
+	h.last_slot = idx->last_slot;
+	h.first = idx->first;
+	h.last = idx->last;
+	h.text_start = idx->text_start;
+	h.text_end = idx->text_end;
+	h.strings_len = idx->strings_len;
+	h.source_size = st->st_size;
+	h.source_mtime = stat_mtime(st);
+	h.source_checksum = checksum;
+
+	tmp = malloc(strlen(path) + 32);
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		free(tmp);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) == 1 &&
+			fwrite(zeroes, symbol_cache_keys_offset() - sizeof(h), 1, f) == 1 &&
+			fwrite(idx->keys, sizeof(uint64_t), idx->size + 1, f) == idx->size + 1 &&
+			fwrite(idx->slots, sizeof(symbol_t), idx->size + 1, f) == idx->size + 1 &&
+			fwrite(idx->strings, idx->strings_len, 1, f) == 1)
+		ret = 0;
+	if (fclose(f))
+		ret = -1;
+	if (ret == 0 && rename(tmp, path))
+		ret = -1;
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+symbol_index_t *symbol_index_open(const char *name, int *err)
+{
+	symbol_index_t *idx = NULL;
+	uint64_t checksum;
+	struct stat st;
+	char *cache;
+	bool mapped;
+	size_t size;
+	char *data;
+	int ret;
+
+	*err = 0;
+	if (stat(name, &st)) {
+		*err = -errno;
+		return NULL;
+	}
+	// there is no point in caching what can change any time, like /proc/kallsyms
+	cache = NULL;
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		cache = malloc(strlen(name) + sizeof(SYMBOL_CACHE_SUFFIX));
+		if (!cache) {
+			*err = -ENOMEM;
+			return NULL;
+		}
+		sprintf(cache, "%s%s", name, SYMBOL_CACHE_SUFFIX);
+		idx = symbol_cache_map(cache, &st, NULL);
+		if (idx)
+			goto out;
+	}
+
+	ret = symbol_file_load(name, &data, &size, &mapped);
+	if (ret) {
+		*err = ret;
+		goto out;
+	}
+	checksum = symbol_checksum(data, size);
+	// only the timestamp changed, e.g. after a copy: refresh it
+	if (cache)
+		idx = symbol_cache_map(cache, &st, &checksum);
+	if (!idx) {
+		idx = symbol_index_create(0);
+		if (!idx)
+			ret = -ENOMEM;
+		else
+			ret = symbol_parse(idx, data, size, mapped);
+		if (ret > 0 && symbol_index_build(idx))
+			ret = -ENOMEM;
+		if (ret <= 0) {
+			*err = ret;
+			symbol_index_destroy(idx);
+			idx = NULL;
+		}
+	}
+	symbol_file_release(data, size, mapped);
+	// not being able to write the cache (e.g., a read-only directory) is fine
+	if (idx && cache && (size_t)st.st_size == size)
+		idx->cache_written = !symbol_cache_write(cache, idx, &st, checksum);
+
+out:
+	free(cache);
+	return idx;
+}
+
+/**
+ * Where a descent for addr that ended at (leaf) k found its result: at the
+ * node where it last went right, i.e., above k's trailing zeroes plus one.
+ */
+static inline const symbol_t *symbol_index_result(const symbol_index_t *idx, unsigned int k,
+		uint64_t addr)
+{
+	const symbol_t *sym;
+
+	k >>= __builtin_ctz(k) + 1;
+	if (k == 0)
+		return NULL;
+	sym = &idx->slots[k];
+	// only an address of UINT64_MAX can end up on padding
+	if (!sym->name)
+		sym = &idx->slots[idx->last_slot];
+	// in a gap between two functions
+	if (sym->size && addr - sym->addr >= sym->size)
+		return NULL;
+	return sym;
+}
+const symbol_t *symbol_index_lookup(const symbol_index_t *idx, uint64_t addr)
+{
+	unsigned int k = 1, l;
+
+	for (l = 0; l < idx->levels; l++) {
+		__builtin_prefetch(&idx->keys[SYMBOL_INDEX_LINE_KEYS * k]);
+		k = 2 * k + (idx->keys[k] <= addr);
+	}
+	return symbol_index_result(idx, k, addr);
+}
+
+void symbol_index_lookup_batch(const symbol_index_t *idx, const uint64_t *addrs,
+		unsigned int nr, const symbol_t **syms)
+{
+	unsigned int k[SYMBOL_INDEX_BATCH];
+	unsigned int i, j, l, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i < SYMBOL_INDEX_BATCH ? nr - i : SYMBOL_INDEX_BATCH;
+		for (j = 0; j < n; j++)
+			k[j] = 1;
+		// all descents take the same number of steps, so go level by level
+		for (l = 0; l < idx->levels; l++) {
+			for (j = 0; j < n; j++) {
+				__builtin_prefetch(&idx->keys[SYMBOL_INDEX_LINE_KEYS * k[j]]);
+				k[j] = 2 * k[j] + (idx->keys[k[j]] <= addrs[i + j]);
+			}
+		}
+		for (j = 0; j < n; j++)
+			syms[i + j] = symbol_index_result(idx, k[j], addrs[i + j]);
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ * uniprof: memo of formatted symbol lookups
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <symbol-memo.h>
+
+symbol_memo_t *symbol_memo_create(unsigned int nr_entries)
+{
+	symbol_memo_t *memo;
+	unsigned int n;
+
+	if (nr_entries == 0)
+		return NULL;
+	// at least one set of two
+	n = 2;
+	while (n < nr_entries)
+		n <<= 1;
+	memo = malloc(sizeof(symbol_memo_t));
+	if (!memo)
+		return NULL;
+	memo->entries = calloc(n, sizeof(symbol_memo_entry_t));
+	if (!memo->entries) {
+		free(memo);
+		return NULL;
+	}
+	memo->mask = n - 1;
+	memo->hits = 0;
+	memo->misses = 0;
+	return memo;
+}
+
+void symbol_memo_destroy(symbol_memo_t *memo)
+{
+	unsigned int i;
+
+	if (!memo)
+		return;
+	for (i = 0; i <= memo->mask; i++)
+		free(memo->entries[i].text);
+	free(memo->entries);
+	free(memo);
+}
+
+/* the set of two entries addr can be in */
+static inline symbol_memo_entry_t *symbol_memo_set(symbol_memo_t *memo, uint64_t addr)
+{
+	// Fibonacci hashing: the upper half of the product is well mixed
+	return &memo->entries[((addr * 0x9e3779b97f4a7c15ULL) >> 32) & memo->mask & ~1U];
+}
+
+const char *symbol_memo_lookup(symbol_memo_t *memo, uint64_t addr, size_t *len)
+{
+	symbol_memo_entry_t *set = symbol_memo_set(memo, addr);
+	symbol_memo_entry_t tmp;
+
+	if (set[0].text && set[0].addr == addr) {
+		memo->hits++;
+		*len = set[0].len;
+		return set[0].text;
+	}
+	if (set[1].text && set[1].addr == addr) {
+		// keep the entry we used last in the first way, so it is evicted last
+		tmp = set[0];
+		set[0] = set[1];
+		set[1] = tmp;
+		memo->hits++;
+		*len = set[0].len;
+		return set[0].text;
+	}
+	memo->misses++;
+	return NULL;
+}
+
+int symbol_memo_insert(symbol_memo_t *memo, uint64_t addr, const char *text, size_t len)
+{
+	symbol_memo_entry_t *set = symbol_memo_set(memo, addr);
+	char *copy;
+
+	copy = malloc(len);
+	if (!copy)
+		return -1;
+	memcpy(copy, text, len);
+	// the newest entry goes first, the one used less recently is dropped
+	free(set[1].text);
+	set[1] = set[0];
+	set[0].addr = addr;
+	set[0].text = copy;
+	set[0].len = len;
+	return 0;
+}
@@ -36,64 +36,116 @@
 #include <inttypes.h>
 #include <fstream>
 #include <iostream>
-#include <map>
 #include <sstream>
+#include <string.h>
+#include <vector>
+#include <symbol-index.h>
+#include <trace-format.h>
+
+/* print addr as an offset into sym, the symbol it was looked up in */
+static void print_symbol(symbol_index_t *symbols, const symbol_t *sym, uint64_t addr) {
+	if (!sym)
+		std::cout << "0x" << std::hex << addr << std::endl;
+	else if (addr == sym->addr)
+		std::cout << symbol_name(symbols, sym) << std::endl;
+	else
+		std::cout << symbol_name(symbols, sym) << "+0x" << std::hex << addr - sym->addr << std::endl;
+}
+
+/**
+ * Symbolize a binary trace, writing the text format. Returns 1 if the file
+ * isn't a binary trace, 0 on success, and a negative value on errors.
+ */
+static int symbolize_binary(symbol_index_t *symbols, const char *name) {
+	std::vector<const symbol_t *> syms;
+	trace_reader_t reader;
+	trace_sample_t sample = {};
+	unsigned int i;
+	FILE *f;
+	int ret;
+
+	f = fopen(name, "r");
+	if (!f)
+		return -1;
+	ret = trace_reader_open(&reader, f);
+	if (ret) {
+		fclose(f);
+		return ret;
+	}
+	trace_print_text_header(stdout, &reader.header);
+	while ((ret = trace_read_sample(&reader, &sample)) > 0) {
+		if (sample.rate) {
+			std::cout << "#period " << std::dec << sample.period << " ns" << std::endl;
+			continue;
+		}
+		if (sample.idle)
+			std::cout << "[idle]" << std::endl;
+		// look up the whole stack at once
+		syms.resize(sample.nr_frames);
+		if (sample.nr_frames)
+			symbol_index_lookup_batch(symbols, sample.frames, sample.nr_frames, &syms[0]);
+		for (i = 0; i < sample.nr_frames; i++)
+			print_symbol(symbols, syms[i], sample.frames[i]);
+		std::cout << std::dec << sample.complete << std::endl << std::endl;
+	}
+	free(sample.frames);
+	fclose(f);
+	return ret;
+}
 
 int main(int argc, char **argv) {
-	std::ifstream symbolfile;
 	std::ifstream tracefile;
 	std::string line;
 	std::stringstream convertor;
 	uint64_t addr;
-	std::string hexaddr;
-	char type;
-	std::string fname;
-	std::map<uint64_t, std::string> symbollist;
-	std::map<uint64_t, std::string>::iterator iter;
+	symbol_index_t *symbols;
+	int ret;
 
 	if (argc != 3) {
 		std::cout << "Usage: " << argv[0] << " <symbol_table> <trace_file>" << std::endl;
 		return 1;
 	}
 
-	symbolfile.open(argv[1], std::ifstream::in);
-	if (symbolfile.fail()) {
-		std::cout << "Failed opening symbol table file \"" << argv[1] << "\".";
+	// an ELF image, or the output of nm
+	symbols = symbol_index_open(argv[1], &ret);
+	if (!symbols && ret < 0) {
+		std::cout << "Failed reading symbol table file \"" << argv[1] << "\": " << strerror(-ret) << ".";
 		return 2;
 	}
+	if (!symbols) {
+		std::cout << "Symbol table file \"" << argv[1] << "\" contained no valid entries.";
+		return 2;
+	}
+
+	ret = symbolize_binary(symbols, argv[2]);
+	if (ret == 0)
+		return 0;
+	else if (ret < 0) {
+		std::cout << "Failed reading binary trace file \"" << argv[2] << "\".";
+		return 2;
+	}
+
 	tracefile.open(argv[2], std::ifstream::in);
 	if (tracefile.fail()) {
 		std::cout << "Failed opening trace file \"" << argv[2] << "\".";
 		return 2;
 	}
 
-	while (std::getline(symbolfile, line)) {
-		convertor.str(line);
-		convertor >> std::hex >> addr >> type >> fname;
-		convertor.clear();
-		symbollist[addr] = fname;
-	}
-	symbolfile.close();
-
 	while (std::getline(tracefile, line)) {
 		if (line.empty())
 			std::cout << std::endl;
-		else if (line == "1")
-			std::cout << "1" << std::endl;
-		// comments; by convention, the header lines start with a comment sign
-		else if (line[0] == '#')
+		// end of a (complete or incomplete) stack trace
+		else if (line == "1" || line == "0")
+			std::cout << line << std::endl;
+		// comments; by convention, the header lines start with a comment sign.
+		// Markers like [idle] aren't addresses, so pass them through as well.
+		else if (line[0] == '#' || line[0] == '[')
 			std::cout << line << std::endl;
 		else {
 			convertor.str(line);
 			convertor >> std::hex >> addr;
 			convertor.clear();
-			iter = symbollist.upper_bound(addr);
-			if (iter != symbollist.begin())
-				iter--;
-			if (addr == iter->first)
-				std::cout << iter->second.c_str() << std::endl;
-			else
-				std::cout << iter->second.c_str() << "+0x" << std::hex << addr - iter->first << std::endl;
+			print_symbol(symbols, symbol_index_lookup(symbols, addr), addr);
 		}
 	}
 	tracefile.close();
@@ -0,0 +1,182 @@
+/*
+ * uniprof: absolute-deadline sampling timer and latency histograms
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <timer.h>
+
+#define SUB_BUCKETS (1ULL << LATENCY_HIST_SUB_BITS)
+
+static struct timespec nsec_to_timespec(uint64_t nsecs)
+{
+	struct timespec ts = {
+		.tv_sec = nsecs / 1000000000ULL,
+		.tv_nsec = nsecs % 1000000000ULL,
+	};
+	return ts;
+}
+
+int sample_timer_init(sample_timer_t *timer, sample_timer_mode_t mode, uint64_t spin_nsec)
+{
+	timer->mode = mode;
+	timer->spin_nsec = spin_nsec;
+	timer->fd = -1;
+	if (mode == SAMPLE_TIMER_TIMERFD) {
+		timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (timer->fd < 0)
+			return -1;
+	}
+	return 0;
+}
+
+void sample_timer_destroy(sample_timer_t *timer)
+{
+	if (timer->fd >= 0)
+		close(timer->fd);
+	timer->fd = -1;
+}
+
+uint64_t sample_timer_wait(sample_timer_t *timer, uint64_t deadline)
+{
+	uint64_t now = sample_timer_now();
+	struct itimerspec its = { .it_interval = { 0, 0 } };
+	struct timespec wakeup;
+	uint64_t expirations;
+
+	if (timer->mode != SAMPLE_TIMER_SPIN && deadline > now + timer->spin_nsec) {
+		wakeup = nsec_to_timespec(deadline - timer->spin_nsec);
+		if (timer->mode == SAMPLE_TIMER_TIMERFD) {
+			its.it_value = wakeup;
+			// if anything goes wrong here, we just spin for longer
+			if (!timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &its, NULL))
+				while (read(timer->fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+		}
+		else {
+			// with an absolute deadline, a signal just means we go back to sleep
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR);
+		}
+		now = sample_timer_now();
+	}
+	while (now < deadline)
+		now = sample_timer_now();
+	return now;
+}
+
+int sample_timer_pin(int cpu)
+{
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	return sched_setaffinity(0, sizeof(cpus), &cpus) ? -1 : 0;
+}
+
+int sample_timer_realtime(int priority)
+{
+	struct sched_param param = { .sched_priority = priority };
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param))
+		return -1;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		return -1;
+	return 0;
+}
+
+static unsigned int bucket_of(unsigned long long nsecs)
+{
+	unsigned int shift;
+
+	if (nsecs < SUB_BUCKETS)
+		return nsecs;
+	shift = 63 - __builtin_clzll(nsecs) - LATENCY_HIST_SUB_BITS;
+	return ((shift + 1) << LATENCY_HIST_SUB_BITS) + (nsecs >> shift) - SUB_BUCKETS;
+}
+
+/* the largest value that ends up in bucket */
+static unsigned long long bucket_end(unsigned int bucket)
+{
+	unsigned int shift = bucket >> LATENCY_HIST_SUB_BITS;
+	unsigned long long sub = bucket & (SUB_BUCKETS - 1);
+
+	if (!shift)
+		return sub;
+	shift--;
+	return ((SUB_BUCKETS + sub) << shift) + (1ULL << shift) - 1;
+}
+
+void latency_hist_add(latency_hist_t *hist, unsigned long long nsecs)
+{
+	hist->counts[bucket_of(nsecs)]++;
+	hist->count++;
+	if (nsecs > hist->max)
+		hist->max = nsecs;
+}
+
+unsigned long long latency_hist_percentile(const latency_hist_t *hist, double pct)
+{
+	double exact = pct / 100.0 * hist->count;
+	unsigned long long rank = exact, seen = 0;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+	if (rank < exact)
+		rank++;
+	if (rank < 1)
+		rank = 1;
+	if (rank > hist->count)
+		rank = hist->count;
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank)
+			break;
+	}
+	return bucket_end(i) < hist->max ? bucket_end(i) : hist->max;
+}
+
+void latency_hist_print(FILE *f, const char *what, const latency_hist_t *hist)
+{
+	if (!hist->count)
+		return;
+	fprintf(f, "%s: p50 %llu ns, p90 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns over %llu samples\n",
+			what, latency_hist_percentile(hist, 50), latency_hist_percentile(hist, 90),
+			latency_hist_percentile(hist, 99), latency_hist_percentile(hist, 99.9),
+			hist->max, hist->count);
+}
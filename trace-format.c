@@ -0,0 +1,251 @@
+/*
+ * uniprof: binary trace format
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <trace-format.h>
+
+static void put_le(unsigned char *buf, uint64_t val, unsigned int bytes)
+{
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++)
+		buf[i] = (val >> (8 * i)) & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *buf, unsigned int bytes)
+{
+	uint64_t val = 0;
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++)
+		val |= (uint64_t)buf[i] << (8 * i);
+	return val;
+}
+
+size_t trace_put_varint(unsigned char *buf, uint64_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		buf[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[n++] = val;
+	return n;
+}
+
+int trace_get_varint(FILE *f, uint64_t *val)
+{
+	unsigned int shift;
+	int ch;
+
+	*val = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		ch = fgetc(f);
+		if (ch == EOF)
+			return -1;
+		*val |= (uint64_t)(ch & 0x7f) << shift;
+		if (!(ch & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+uint64_t trace_zigzag(uint64_t from, uint64_t to)
+{
+	int64_t d = (int64_t)(to - from);
+
+	return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+}
+
+uint64_t trace_unzigzag(uint64_t from, uint64_t z)
+{
+	return from + ((z >> 1) ^ -(z & 1));
+}
+
+const char *trace_backend_name(unsigned int backend)
+{
+	switch (backend) {
+	case TRACE_BACKEND_LIBXC:
+		return "libxc";
+	case TRACE_BACKEND_XENCALL:
+		return "libxencall";
+	default:
+		return "unknown";
+	}
+}
+
+size_t trace_encode_header(unsigned char *buf, const trace_header_t *h)
+{
+	memset(buf, 0, TRACE_HEADER_SIZE);
+	memcpy(buf, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	put_le(buf + 8, h->version, 2);
+	put_le(buf + 10, h->word_size, 2);
+	put_le(buf + 12, h->domid, 4);
+	put_le(buf + 16, h->frequency, 4);
+	buf[20] = h->backend;
+	put_le(buf + 24, h->start_time, 8);
+	return TRACE_HEADER_SIZE;
+}
+
+size_t trace_encode_sample(unsigned char *buf, trace_codec_t *c, const trace_sample_t *s)
+{
+	uint64_t prev = c->prev_frame;
+	size_t n = 0;
+	unsigned int i;
+
+	if (s->rate) {
+		buf[n++] = TRACE_REC_RATE;
+		n += trace_put_varint(buf + n, s->timestamp - c->prev_time);
+		n += trace_put_varint(buf + n, s->period);
+		c->prev_time = s->timestamp;
+		return n;
+	}
+	buf[n++] = s->idle ? TRACE_REC_IDLE : TRACE_REC_SAMPLE;
+	n += trace_put_varint(buf + n, s->vcpu);
+	n += trace_put_varint(buf + n, s->timestamp - c->prev_time);
+	c->prev_time = s->timestamp;
+	if (s->idle)
+		return n;
+	n += trace_put_varint(buf + n, s->nr_frames);
+	buf[n++] = !!s->complete;
+	for (i = 0; i < s->nr_frames; i++) {
+		n += trace_put_varint(buf + n, trace_zigzag(prev, s->frames[i]));
+		prev = s->frames[i];
+	}
+	if (s->nr_frames)
+		c->prev_frame = s->frames[0];
+	return n;
+}
+
+int trace_reader_open(trace_reader_t *r, FILE *f)
+{
+	unsigned char buf[TRACE_HEADER_SIZE];
+	size_t n;
+
+	memset(r, 0, sizeof(*r));
+	r->f = f;
+	n = fread(buf, 1, TRACE_HEADER_SIZE, f);
+	if (n < sizeof(TRACE_MAGIC) || memcmp(buf, TRACE_MAGIC, sizeof(TRACE_MAGIC)))
+		return ferror(f) ? -EIO : 1;
+	if (n < TRACE_HEADER_SIZE)
+		return -EIO;
+	r->header.version = get_le(buf + 8, 2);
+	// versions 2 and 3 only added record types, so we can still read version 1
+	if (r->header.version < 1 || r->header.version > TRACE_VERSION)
+		return -ENOTSUP;
+	r->header.word_size = get_le(buf + 10, 2);
+	r->header.domid = get_le(buf + 12, 4);
+	r->header.frequency = get_le(buf + 16, 4);
+	r->header.backend = buf[20];
+	r->header.start_time = get_le(buf + 24, 8);
+	return 0;
+}
+
+int trace_read_sample(trace_reader_t *r, trace_sample_t *s)
+{
+	uint64_t vcpu, delta, nr, z, prev, period;
+	uint64_t *frames;
+	unsigned int i;
+	int tag, complete;
+
+	tag = fgetc(r->f);
+	if (tag == EOF)
+		return ferror(r->f) ? -EIO : 0;
+	if (tag == TRACE_REC_RATE) {
+		if (trace_get_varint(r->f, &delta) || trace_get_varint(r->f, &period))
+			return -EINVAL;
+		s->timestamp = r->codec.prev_time + delta;
+		s->rate = 1;
+		s->period = period;
+		s->idle = 0;
+		s->nr_frames = 0;
+		r->codec.prev_time = s->timestamp;
+		return 1;
+	}
+	if (tag != TRACE_REC_SAMPLE && tag != TRACE_REC_IDLE)
+		return -EINVAL;
+	s->rate = 0;
+	if (trace_get_varint(r->f, &vcpu) || trace_get_varint(r->f, &delta))
+		return -EINVAL;
+	if (tag == TRACE_REC_IDLE) {
+		s->vcpu = vcpu;
+		s->timestamp = r->codec.prev_time + delta;
+		s->complete = 1;
+		s->idle = 1;
+		s->nr_frames = 0;
+		r->codec.prev_time = s->timestamp;
+		return 1;
+	}
+	if (trace_get_varint(r->f, &nr))
+		return -EINVAL;
+	complete = fgetc(r->f);
+	if (complete == EOF || nr > UINT32_MAX)
+		return -EINVAL;
+	if (nr > s->frames_size) {
+		frames = realloc(s->frames, nr * sizeof(uint64_t));
+		if (!frames)
+			return -ENOMEM;
+		s->frames = frames;
+		s->frames_size = nr;
+	}
+	prev = r->codec.prev_frame;
+	for (i = 0; i < nr; i++) {
+		if (trace_get_varint(r->f, &z))
+			return -EINVAL;
+		s->frames[i] = prev = trace_unzigzag(prev, z);
+	}
+	s->vcpu = vcpu;
+	s->timestamp = r->codec.prev_time + delta;
+	s->complete = complete;
+	s->idle = 0;
+	s->nr_frames = nr;
+	r->codec.prev_time = s->timestamp;
+	if (nr)
+		r->codec.prev_frame = s->frames[0];
+	return 1;
+}
+
+void trace_print_text_header(FILE *f, const trace_header_t *h)
+{
+	char timestring[64];
+	time_t t = h->start_time / 1000000000ULL;
+
+	strftime(timestring, 63, "%Y-%m-%d %H:%M:%S %Z (%z)", localtime(&t));
+	fprintf(f, "#unikernel stack tracer using %s hypercall interface\n", trace_backend_name(h->backend));
+	fprintf(f, "#tracing domid %d on %s\n\n", h->domid, timestring);
+}
@@ -0,0 +1,97 @@
+/*
+ * binary to text trace converter (for use with uniprof)
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace-format.h>
+
+int main(int argc, char **argv) {
+	trace_reader_t reader;
+	trace_sample_t sample;
+	FILE *in, *out = stdout;
+	unsigned int i;
+	int ret;
+
+	if (argc != 2 && argc != 3) {
+		printf("Usage: %s <binary_trace> [<text_trace>]\n", argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "Failed opening trace file \"%s\": %s\n", argv[1], strerror(errno));
+		return 2;
+	}
+	if (argc == 3 && strcmp(argv[2], "-")) {
+		out = fopen(argv[2], "w");
+		if (!out) {
+			fprintf(stderr, "Failed opening output file \"%s\": %s\n", argv[2], strerror(errno));
+			return 2;
+		}
+	}
+
+	ret = trace_reader_open(&reader, in);
+	if (ret) {
+		fprintf(stderr, "\"%s\" is not a binary uniprof trace%s\n", argv[1],
+				ret == -ENOTSUP ? " of a supported version" : "");
+		return 3;
+	}
+
+	trace_print_text_header(out, &reader.header);
+	memset(&sample, 0, sizeof(sample));
+	while ((ret = trace_read_sample(&reader, &sample)) > 0) {
+		if (sample.rate) {
+			fprintf(out, "#period %"PRIu64" ns\n", sample.period);
+			continue;
+		}
+		if (sample.idle)
+			fprintf(out, "[idle]\n");
+		for (i = 0; i < sample.nr_frames; i++)
+			fprintf(out, "%#"PRIx64"\n", sample.frames[i]);
+		fprintf(out, "%d\n\n", sample.complete);
+	}
+	if (ret < 0)
+		fprintf(stderr, "Trace file \"%s\" is corrupt, stopped converting.\n", argv[1]);
+
+	free(sample.frames);
+	fclose(in);
+	if (fclose(out)) {
+		fprintf(stderr, "Failed writing output: %s\n", strerror(errno));
+		return 4;
+	}
+	return ret < 0 ? 3 : 0;
+}
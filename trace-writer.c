@@ -0,0 +1,259 @@
+/*
+ * uniprof: buffered trace writer with a background I/O thread
+ *
+ * Authors: Florian Schmidt <florian.schmidt@neclab.eu>
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <timer.h>
+#include <trace-writer.h>
+
+struct trace_writer {
+	int fd;
+	bool close_fd;
+	size_t buf_size;
+	unsigned char *bufs[TRACE_WRITER_NR_BUFFERS];
+	size_t lens[TRACE_WRITER_NR_BUFFERS];
+	/* buffers are used round-robin. fill is the one the caller writes into,
+	 * the nr_queued ones before it wait for (or are in) the I/O thread */
+	unsigned int fill;
+	unsigned int nr_queued;
+	bool closing;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;          /* signalled when a buffer is queued */
+	pthread_cond_t drained;         /* signalled when buffers are free again */
+	pthread_t thread;
+	trace_writer_stats_t stats;
+};
+
+/* write out iovs completely, coping with short writes */
+static int write_iovs(trace_writer_t *w, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = writev(w->fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		w->stats.writes++;
+		w->stats.bytes_written += n;
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void *io_thread(void *arg)
+{
+	trace_writer_t *w = arg;
+	struct iovec iov[TRACE_WRITER_NR_BUFFERS];
+	unsigned int first, nr, i;
+	int ret;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->nr_queued && !w->closing)
+			pthread_cond_wait(&w->queued, &w->lock);
+		if (!w->nr_queued)
+			break;
+		// write everything queued so far in one go
+		nr = w->nr_queued;
+		first = (w->fill + TRACE_WRITER_NR_BUFFERS - nr) % TRACE_WRITER_NR_BUFFERS;
+		pthread_mutex_unlock(&w->lock);
+
+		for (i = 0; i < nr; i++) {
+			iov[i].iov_base = w->bufs[(first + i) % TRACE_WRITER_NR_BUFFERS];
+			iov[i].iov_len = w->lens[(first + i) % TRACE_WRITER_NR_BUFFERS];
+		}
+		// after an error, keep draining so the caller never blocks forever
+		ret = w->error ? 0 : write_iovs(w, iov, nr);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret && !w->error)
+			w->error = ret;
+		w->nr_queued -= nr;
+		pthread_cond_signal(&w->drained);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* hand the current buffer to the I/O thread and switch to the next free one */
+static void queue_buffer(trace_writer_t *w)
+{
+	uint64_t begin;
+
+	pthread_mutex_lock(&w->lock);
+	w->nr_queued++;
+	w->fill = (w->fill + 1) % TRACE_WRITER_NR_BUFFERS;
+	pthread_cond_signal(&w->queued);
+	if (w->nr_queued == TRACE_WRITER_NR_BUFFERS) {
+		w->stats.stalls++;
+		begin = sample_timer_now();
+		while (w->nr_queued == TRACE_WRITER_NR_BUFFERS)
+			pthread_cond_wait(&w->drained, &w->lock);
+		w->stats.stall_nsec += sample_timer_now() - begin;
+	}
+	pthread_mutex_unlock(&w->lock);
+	w->lens[w->fill] = 0;
+}
+
+trace_writer_t *trace_writer_open(int fd, size_t buf_size, int close_fd)
+{
+	trace_writer_t *w;
+	unsigned int i;
+
+	if (buf_size == 0)
+		return NULL;
+	w = calloc(1, sizeof(trace_writer_t));
+	if (!w)
+		return NULL;
+	w->fd = fd;
+	w->close_fd = close_fd;
+	w->buf_size = buf_size;
+	for (i = 0; i < TRACE_WRITER_NR_BUFFERS; i++) {
+		w->bufs[i] = malloc(buf_size);
+		if (!w->bufs[i])
+			goto out_err;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->queued, NULL);
+	pthread_cond_init(&w->drained, NULL);
+	if (pthread_create(&w->thread, NULL, io_thread, w))
+		goto out_err;
+	return w;
+
+out_err:
+	for (i = 0; i < TRACE_WRITER_NR_BUFFERS; i++)
+		free(w->bufs[i]);
+	free(w);
+	return NULL;
+}
+
+int trace_writer_close(trace_writer_t *w, trace_writer_stats_t *stats)
+{
+	unsigned int i;
+	int ret;
+
+	if (w->lens[w->fill])
+		queue_buffer(w);
+	pthread_mutex_lock(&w->lock);
+	w->closing = true;
+	pthread_cond_signal(&w->queued);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	ret = w->error;
+	if (w->close_fd && close(w->fd) && !ret)
+		ret = -errno;
+	if (stats)
+		*stats = w->stats;
+	pthread_cond_destroy(&w->drained);
+	pthread_cond_destroy(&w->queued);
+	pthread_mutex_destroy(&w->lock);
+	for (i = 0; i < TRACE_WRITER_NR_BUFFERS; i++)
+		free(w->bufs[i]);
+	free(w);
+	return ret;
+}
+
+int trace_writer_write(trace_writer_t *w, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t chunk;
+
+	while (len) {
+		chunk = w->buf_size - w->lens[w->fill];
+		if (chunk > len)
+			chunk = len;
+		memcpy(w->bufs[w->fill] + w->lens[w->fill], p, chunk);
+		w->lens[w->fill] += chunk;
+		p += chunk;
+		len -= chunk;
+		if (w->lens[w->fill] == w->buf_size)
+			queue_buffer(w);
+	}
+	return 0;
+}
+
+int trace_writer_printf(trace_writer_t *w, const char *fmt, ...)
+{
+	va_list ap;
+	size_t space;
+	char *line;
+	int n;
+
+	space = w->buf_size - w->lens[w->fill];
+	va_start(ap, fmt);
+	n = vsnprintf((char *)w->bufs[w->fill] + w->lens[w->fill], space, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return n;
+	if ((size_t)n >= space) {
+		// didn't fit (vsnprintf needs room for the terminator, too)
+		if ((size_t)n >= w->buf_size) {
+			// longer than a whole buffer: format it elsewhere, and copy it in pieces
+			line = malloc(n + 1);
+			if (!line)
+				return -ENOMEM;
+			va_start(ap, fmt);
+			vsnprintf(line, n + 1, fmt, ap);
+			va_end(ap);
+			trace_writer_write(w, line, n);
+			free(line);
+			return n;
+		}
+		queue_buffer(w);
+		va_start(ap, fmt);
+		n = vsnprintf((char *)w->bufs[w->fill], w->buf_size, fmt, ap);
+		va_end(ap);
+	}
+	w->lens[w->fill] += n;
+	return n;
+}
@@ -32,6 +32,7 @@
  *
  */
 
+#define _GNU_SOURCE             // for CPU affinity
 #include <config.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -41,20 +42,174 @@
 #include <time.h>
 #include <errno.h>
 #include <getopt.h>
-#include <binsearch.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <symbol-index.h>
+#include <symbol-memo.h>
 #include <xen-interface.h>
+#include <page-cache.h>
+#include <sample-ring.h>
+#include <trace-writer.h>
+#include <trace-format.h>
+#include <stack-agg.h>
+#include <calling-context.h>
+#include <timer.h>
+#include <instrument.h>
 #ifdef WITH_UNWIND
 #include <libunwind.h>
 #include <libunwind-xen.h>
 #endif
 
-typedef struct mapped_page {
-	guest_word_t base; // page number, i.e. addr>>PAGE_SHIFT
-	unsigned long mfn;
-	void *buf;
-	struct mapped_page *next;
-} mapped_page_t;
+/* Deep enough for any sane stack, and stops us from following frame
+ * pointer loops forever. */
+#define MAX_STACK_DEPTH 512
+#define DEFAULT_SNAPSHOT_KIB 16
+#define DEFAULT_QUEUE_LENGTH 64
+/* how often the governor reconsiders the sampling rate */
+#define GOVERNOR_INTERVAL_NSEC 100000000UL
+/* with "all", we profile at most this many domains */
+#define MAX_DOMAINS 1024
+/* stands in for the stack of an idle or offline vCPU in the output */
+#define IDLE_FRAME_NAME "[idle]"
+/* with -O, frame pointers further than this above the stack pointer are bogus */
+#define OPTIMISTIC_STACK_LIMIT (1024 * 1024)
+
+/* the return addresses of one stack walk */
+typedef struct {
+	unsigned int vcpu;
+	uint64_t timestamp;             // when the sample was taken (CLOCK_MONOTONIC)
+	unsigned int nr_frames;
+	bool complete;          // walked all the way to a NULL frame pointer
+	bool idle;              // the vCPU was idle or offline, there are no frames
+	bool torn;              // failed a sanity check or a read (-O), frames end before that
+	guest_word_t frames[MAX_STACK_DEPTH];
+} stack_trace_t;
+
+/* a copy of the top of a vCPU's stack, taken while the domain is paused */
+typedef struct {
+	int ret;                // result of fetching the vCPU context
+	bool idle;              // the vCPU was idle or offline, nothing was copied
+	guest_word_t ip, fp;    // register contents at the time of the copy
+	guest_word_t base;      // guest address of data[0], i.e., the stack pointer
+	size_t len;             // number of valid bytes in data
+	size_t size;            // capacity of data
+	unsigned char *data;
+} stack_snapshot_t;
+
+/* one slot in the sample ring: the stack snapshots of all vCPUs */
+typedef struct {
+	uint64_t timestamp;
+	uint64_t period;        // the sampling period at the time, see write_rate_change()
+	stack_snapshot_t *vcpus;
+} sample_t;
+
+/* a thread that helps walking the vCPUs of a sample while the domain is paused */
+typedef struct {
+	pthread_t thread;
+	unsigned int index;
+	sem_t start;            // posted once per sample
+	int cpu;                // the CPU it is pinned to, or -1
+	int ret;                // 0 if it set up its handles and page cache
+} walker_t;
+
+/* the walker threads, and the sample they are working on */
+typedef struct {
+	unsigned int nr;
+	walker_t *walkers;
+	sem_t ready;            // posted by each walker once it is set up
+	unsigned int page_cache_capacity;
+	int domid;
+	unsigned int max_vcpu_id;
+	int wordsize;
+	stack_snapshot_t *snaps;
+	atomic_uint next_vcpu;  // vCPUs are handed out one at a time
+	atomic_uint done;       // walkers finished with this sample
+	atomic_bool stop;
+} walker_pool_t;
+
+/* state of the background thread that unwinds and writes deferred samples */
+typedef struct {
+	pthread_t thread;
+	sem_t wakeup;
+	atomic_bool stop;
+	int domid;
+	unsigned int max_vcpu_id;
+	int wordsize;
+	trace_writer_t *out;
+	symbol_index_t *symbol_table;
+	uint64_t period;        // the last sampling period written to out
+	stack_trace_t trace;
+} unwind_worker_t;
+
+/* everything we keep per profiled domain */
+typedef struct {
+	int domid;
+	unsigned int max_vcpu_id;
+	int wordsize;
+	uint64_t deadline;              // of the next sample (CLOCK_MONOTONIC)
+	uint64_t period;                // between two samples, in ns
+	uint64_t written_period;        // the last period recorded in the trace
+	uint64_t last_pause;            // how long the last sample paused the domain
+	uint64_t shutdown_check;        // when to next check whether it shut down
+	unsigned long long governor_cost;       // see govern_rate()
+	unsigned long long governor_samples;
+	uint64_t governor_since;
+	unsigned int rate_changes;
+	unsigned long long samples;     // taken so far
+	unsigned long long samples_left;
+	vcpu_guest_context_transparent_t *vcpu_contexts;
+	int *vcpu_context_rets;
+	stack_trace_t *stack_traces;
+	stack_snapshot_t *stack_snapshots;
+	unsigned char *vcpu_states;
+	unsigned char *vcpu_idle;
+	page_cache_t *page_cache;       // for the sampling thread
+	page_cache_t **walker_caches;   // one per walker thread, created by the walker
+	symbol_index_t *symbol_table;
+	symbol_memo_t *symbol_memo;     // formatted frames, for text traces
+	guest_word_t text_start, text_end;      // see plausible_text()
+	char *outname;
+	trace_writer_t *out;
+	trace_codec_t codec;
+	stack_agg_t *stack_agg;
+	cct_t *cct;
+	sig_atomic_t profile_dumps;     // SIGUSR1s handled so far
+} domain_t;
 
+/* every thread that reads guest memory has its own mappings */
+static __thread page_cache_t *page_cache;
+/* the domain we are taking a sample of */
+static domain_t *dom;
+static sample_ring_t *sample_ring = NULL;
+static unwind_worker_t *unwind_worker = NULL;
+static walker_pool_t *walker_pool = NULL;
+static unsigned long long dropped_samples = 0;
+/* what to do with vCPUs that are blocked or offline when we take a sample */
+enum idle_mode { IDLE_MARK, IDLE_SKIP, IDLE_WALK };
+static enum idle_mode idle_mode = IDLE_MARK;
+static unsigned long long idle_vcpu_samples = 0;
+/* the sums of the per-thread page cache counters, see destroy_page_cache() */
+static struct {
+	pthread_mutex_t lock;
+	unsigned long long cache_hits, cache_misses, cache_evictions;
+} thread_stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+/* optimistic mode: walk without pausing the domain, and check what we read */
+static bool optimistic = false;
+/* with the governor, the fraction of time a domain may be paused (0: off) */
+static double overhead_budget = 0;
+static uint64_t shortest_period, longest_period;
+static unsigned long long optimistic_accepted = 0;
+static unsigned long long optimistic_truncated = 0;
+static unsigned long long optimistic_rejected = 0;
+static bool binary_output = false;
+static volatile sig_atomic_t profile_dump_requests = 0;
+static FILE *pause_log = NULL;
 static bool verbose = false;
 #define VERBOSE(args...) if (verbose) printf(args);
 
@@ -98,17 +253,45 @@ do {								\
 	(b)->tv_nsec = 1000000000 - (a)->tv_nsec;		\
 } while (0)
 
-static unsigned long get_time_nsec(void)
+/* min/avg/max bookkeeping for durations in nanoseconds */
+typedef struct {
+	unsigned long long count;
+	unsigned long long total;
+	unsigned long long min;
+	unsigned long long max;
+} duration_stats_t;
+
+static duration_stats_t pause_stats = { .min = ULLONG_MAX };
+
+static void duration_stats_add(duration_stats_t *stats, unsigned long long nsecs)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	stats->count++;
+	stats->total += nsecs;
+	if (nsecs < stats->min)
+		stats->min = nsecs;
+	if (nsecs > stats->max)
+		stats->max = nsecs;
 }
-static void busywait(unsigned long nsecs)
+
+static void duration_stats_print(const char *what, duration_stats_t *stats)
+{
+	if (!stats->count)
+		return;
+	printf("%s: avg %llu ns, min %llu ns, max %llu ns over %llu samples\n", what,
+			stats->total / stats->count, stats->min, stats->max, stats->count);
+}
+
+/* add the counters of a page cache to the totals, and get rid of it */
+static void destroy_page_cache(page_cache_t *pc)
 {
-	unsigned long deadline = get_time_nsec() + nsecs;
-	do {
-	} while (get_time_nsec() < deadline);
+	if (!pc)
+		return;
+	pthread_mutex_lock(&thread_stats.lock);
+	thread_stats.cache_hits += pc->hits;
+	thread_stats.cache_misses += pc->misses;
+	thread_stats.cache_evictions += pc->evictions;
+	pthread_mutex_unlock(&thread_stats.lock);
+	page_cache_destroy(pc);
 }
 
 static void measure_overheads(struct timespec *gettime_overhead, struct timespec *minsleep, int rounds)
@@ -156,147 +339,752 @@ int domain_shut_down(int domid) {
 	return 0;
 }
 
-void *guest_to_host(int domid, int vcpu, guest_word_t gaddr) {
-	static mapped_page_t *map_head = NULL;
-	mapped_page_t *map_iter;
-	mapped_page_t *new_item;
+static void *__guest_to_host(int domid, int vcpu, guest_word_t gaddr, bool warn) {
 	guest_word_t base = gaddr & PAGE_MASK;
 	guest_word_t offset = gaddr & ~PAGE_MASK;
+	unsigned long mfn;
+	void *buf;
 
-	map_iter = map_head;
-	while (map_iter != NULL) {
-		if (base == map_iter->base)
-			return map_iter->buf + offset;
-		// preserve last item in map_iter by jumping out
-		if (map_iter->next == NULL)
-			break;
-		map_iter = map_iter->next;
-	}
+	buf = page_cache_lookup(page_cache, base);
+	if (buf)
+		return buf + offset;
 
 	// no matching page found, we need to map a new one.
-	// At this pointer, map_iter conveniently points to the last item.
-	new_item = malloc(sizeof(mapped_page_t));
-	if (new_item == NULL) {
-		fprintf(stderr, "failed to allocate memory for page struct.\n");
+	INSTR_START(map_begin);
+	xen_map_domu_page(domid, vcpu, base, &mfn, &buf);
+	INSTR_STOP(INSTR_MAP, map_begin);
+	VERBOSE("mapping new page %#"PRIx64"->%p\n", base, buf);
+	if (buf == NULL) {
+		if (warn)
+			fprintf(stderr, "failed to allocate memory mapping page.\n");
 		return NULL;
 	}
-	new_item->base = base;
-	xen_map_domu_page(domid, vcpu, base, &new_item->mfn, &new_item->buf);
-	VERBOSE("mapping new page %#"PRIx64"->%p\n", new_item->base, new_item->buf);
-	if (new_item->buf == NULL) {
-		fprintf(stderr, "failed to allocate memory mapping page.\n");
-		goto out_free;
-	}
-	if (new_item->mfn == 0) {
-		fprintf(stderr, "failed to resolve virtual address.\n");
-		goto out_free;
+	if (mfn == 0) {
+		if (warn)
+			fprintf(stderr, "failed to resolve virtual address.\n");
+		xen_unmap_domu_page(buf);
+		return NULL;
 	}
-	new_item->next = NULL;
-	if (map_head == NULL)
-		map_head = new_item;
-	else
-		map_iter->next = new_item;
-	return new_item->buf + offset;
+	page_cache_insert(page_cache, base, mfn, buf);
+	return buf + offset;
+}
 
-out_free:
-	free(new_item);
-	return NULL;
+void *guest_to_host(int domid, int vcpu, guest_word_t gaddr) {
+	return __guest_to_host(domid, vcpu, gaddr, true);
 }
 
-void resolve_and_print_symbol(void *symbol_table, guest_word_t address, FILE *file) {
-	element_t *ele;
+/**
+ * Copy up to snap->size bytes of the stack of a (paused) vCPU, starting at
+ * its stack pointer, into snap. Copying stops early at the first page that
+ * is not mapped, which usually means we ran past the top of the stack.
+ */
+void capture_stack(int domid, int vcpu, vcpu_guest_context_transparent_t *vc, stack_snapshot_t *snap) {
+	guest_word_t addr = stack_pointer(vc);
+	size_t chunk;
+	void *src;
 
-	if (!symbol_table) {
-		fprintf(file, "%#"PRIx64"\n", address);
-		return;
+	snap->ip = instruction_pointer(vc);
+	snap->fp = frame_pointer(vc);
+	snap->base = addr;
+	snap->len = 0;
+	while (snap->len < snap->size) {
+		chunk = PAGE_SIZE - (addr & ~PAGE_MASK);
+		if (chunk > snap->size - snap->len)
+			chunk = snap->size - snap->len;
+		// don't complain, running off the stack top is expected here
+		src = __guest_to_host(domid, vcpu, addr, false);
+		if (!src)
+			break;
+		memcpy(snap->data + snap->len, src, chunk);
+		snap->len += chunk;
+		addr += chunk;
 	}
+	DBG("vcpu %d, captured %zu stack bytes from %#"PRIx64"\n", vcpu, snap->len, snap->base);
+}
 
-	ele = binsearch_find_not_above(symbol_table, address);
-	if (!ele)
-		fprintf(file, "%#"PRIx64"\n", address);
-	else {
-		if (address == ele->key)
-			fprintf(file, "%#"PRIx64"\n", address);
-		else
-			fprintf(file, "%s+%#"PRIx64"\n", ele->val.c, address - ele->key);
+/**
+ * Read len bytes of stack memory at addr, from the snapshot if one is
+ * given, otherwise from the guest. Returns 0 on success.
+ */
+static int read_stack(int domid, int vcpu, stack_snapshot_t *snap, guest_word_t addr, void *buf, size_t len) {
+	size_t chunk;
+	void *src;
+
+	if (snap) {
+		if (addr < snap->base || addr + len > snap->base + snap->len)
+			return -1;
+		memcpy(buf, snap->data + (addr - snap->base), len);
+		return 0;
 	}
+	// the range might span two pages, which need not be contiguous on our side
+	while (len) {
+		chunk = PAGE_SIZE - (addr & ~PAGE_MASK);
+		if (chunk > len)
+			chunk = len;
+		src = guest_to_host(domid, vcpu, addr);
+		if (!src)
+			return -1;
+		memcpy(buf, src, chunk);
+		buf += chunk;
+		addr += chunk;
+		len -= chunk;
+	}
+	return 0;
 }
 
-void walk_stack_fp(int domid, int vcpu, int wordsize, FILE *file, void *symbol_table) {
+/**
+ * Print address as an offset into the symbol it lies in. The memo (if any)
+ * is asked first; otherwise, we look the address up in symbol_table, and
+ * remember the text in the memo for the next time we see the address.
+ */
+void resolve_and_print_symbol(symbol_index_t *symbol_table, symbol_memo_t *memo,
+		guest_word_t address, trace_writer_t *out) {
+	const symbol_t *sym;
+	const char *text;
+	char buf[512];
+	size_t len;
 	int ret;
-	guest_word_t fp, retaddr;
-	void *hfp, *hrp;
-	vcpu_guest_context_transparent_t vc;
 
-	DBG("tracing vcpu %d\n", vcpu);
-	if ((ret = get_vcpu_context(domid, vcpu, &vc)) < 0) {
-		printf("Failed to get context for VCPU %d, skipping trace. (ret=%d)\n", vcpu, ret);
+	if (memo) {
+		text = symbol_memo_lookup(memo, address, &len);
+		if (text) {
+			trace_writer_write(out, text, len);
+			return;
+		}
+	}
+
+	INSTR_START(lookup_begin);
+	sym = symbol_index_lookup(symbol_table, address);
+	INSTR_STOP(INSTR_SYMBOLS, lookup_begin);
+	if (!sym || address == sym->addr)
+		ret = snprintf(buf, sizeof(buf), "%#"PRIx64"\n", address);
+	else
+		ret = snprintf(buf, sizeof(buf), "%s+%#"PRIx64"\n", symbol_name(symbol_table, sym),
+				address - sym->addr);
+	if (ret < 0)
+		return;
+	if ((size_t)ret >= sizeof(buf)) {
+		// a name this long isn't worth remembering
+		trace_writer_printf(out, "%s+%#"PRIx64"\n", symbol_name(symbol_table, sym),
+				address - sym->addr);
 		return;
 	}
+	if (memo)
+		symbol_memo_insert(memo, address, buf, ret);
+	trace_writer_write(out, buf, ret);
+}
+
+/* could addr be a return address, i.e., does it point into the kernel? */
+static bool plausible_text(guest_word_t addr) {
+	return addr >= dom->text_start && addr < dom->text_end;
+}
+
+/**
+ * Could fp be the frame pointer that follows prev in the chain of the stack
+ * starting at sp? Stacks grow down, so going up the chain has to take us to
+ * higher addresses, but not further up than any sane stack would reach.
+ * Anything else is a frame that changed under our feet while we read it.
+ */
+static bool plausible_frame(guest_word_t fp, guest_word_t prev, guest_word_t sp, int wordsize) {
+	return fp > prev && fp >= sp && fp - sp < OPTIMISTIC_STACK_LIMIT && !(fp & (wordsize - 1));
+}
+
+/**
+ * Walk the stack of a vCPU via the frame pointer, starting from the given
+ * instruction and frame pointer, and record the return addresses in trace.
+ * Reads stack memory from snap if it is not NULL, and from the (paused)
+ * guest otherwise. In optimistic mode, the guest keeps running while we
+ * walk, so the walk stops at the first frame that doesn't look right, and
+ * marks the trace as torn.
+ */
+void walk_stack_fp(int domid, int vcpu, guest_word_t ip, guest_word_t fp, guest_word_t sp, int wordsize,
+		stack_snapshot_t *snap, stack_trace_t *trace) {
+	guest_word_t frame, retaddr, prev_fp = 0;
+	unsigned char record[2 * sizeof(guest_word_t)];
+
+	DBG("tracing vcpu %d\n", vcpu);
+	trace->vcpu = vcpu;
+	trace->nr_frames = 0;
+	trace->complete = false;
+	trace->idle = false;
+	trace->torn = false;
 
 	// our first "return" address is the instruction pointer
-	retaddr = instruction_pointer(&vc);
-	fp = frame_pointer(&vc);
+	retaddr = ip;
 	DBG("vcpu %d, initial (register-based) fp = %#"PRIx64", retaddr = %#"PRIx64"\n", vcpu, fp, retaddr);
 	while (fp != 0) {
-		if (symbol_table)
-			resolve_and_print_symbol(symbol_table, retaddr, file);
-		else
-			fprintf(file, "%#"PRIx64"\n", retaddr);
+		// a frame pointer chain this long is most likely a loop
+		if (trace->nr_frames == MAX_STACK_DEPTH)
+			return;
+		if (optimistic && (!plausible_text(retaddr) || !plausible_frame(fp, prev_fp, sp, wordsize))) {
+			DBG("vcpu %d, implausible frame: fp = %#"PRIx64", return addr = %#"PRIx64"\n",
+					vcpu, fp, retaddr);
+			trace->torn = true;
+			return;
+		}
+		trace->frames[trace->nr_frames++] = retaddr;
 		/* walk the stack: on x86, the fp points to the address of the previous
 		 * frame pointers, so new_fp = *old_fp. On ARM, the fp points to the
 		 * first address of the next frame, with the frame pointer the first
 		 * (=highest) value in the new frame, so new_fp = *old_fp-wordsize.
 		 * The return address is the following word-sized values on the stack,
-		 * so new_ret = new_fp + wordsize.
-		 * We just have to be careful if the new values reside in different
-		 * 4k pages. In that case, we have to map both separately, because
-		 * they might not be in contiguous memory.
-		 * Otherwise, we can just add wordsize to the fp and get retaddr. */
-#if defined(__i386__) || defined(__x86_64__)
-		hfp = guest_to_host(domid, vcpu, fp);
+		 * so new_ret = new_fp + wordsize. AArch64 frame records look like the
+		 * x86 ones: fp points to the saved fp, followed by the saved lr. */
+#if defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
+		frame = fp;
 #elif defined(__arm__)
-		hfp = guest_to_host(domid, vcpu, fp-wordsize);
+		frame = fp - wordsize;
 #endif
-		if (!hfp) {
-			fprintf(file, "0\n\n");
+		if (read_stack(domid, vcpu, snap, frame, record, 2 * wordsize)) {
+			// with the guest running, an unreadable frame is as suspect as an implausible one
+			trace->torn = optimistic;
+			return;
+		}
+		prev_fp = fp;
+		fp = 0;
+		retaddr = 0;
+		memcpy(&fp, record, wordsize);
+		memcpy(&retaddr, record + wordsize, wordsize);
+		DBG("vcpu %d, frame at %#"PRIx64": fp = %#"PRIx64", return addr = %#"PRIx64"\n",
+				vcpu, frame, fp, retaddr);
+	}
+	trace->complete = true;
+}
+
+static void write_binary_trace(stack_trace_t *trace, trace_writer_t *out) {
+	// only ever used by one thread at a time, like the writer itself
+	static unsigned char buf[TRACE_SAMPLE_MAX_SIZE(MAX_STACK_DEPTH)];
+	trace_sample_t sample = {
+		.vcpu = trace->vcpu,
+		.timestamp = trace->timestamp,
+		.complete = trace->complete,
+		.nr_frames = trace->nr_frames,
+		.frames = trace->frames,
+		.idle = trace->idle,
+	};
+
+	trace_writer_write(out, buf, trace_encode_sample(buf, &dom->codec, &sample));
+}
+
+/**
+ * Record that samples are period ns apart from now on. Only the governor
+ * changes the rate, so traces without it never contain this.
+ */
+static void write_rate_change(trace_writer_t *out, uint64_t timestamp, uint64_t period) {
+	unsigned char buf[TRACE_SAMPLE_MAX_SIZE(0)];
+	trace_sample_t sample = {
+		.rate = 1,
+		.timestamp = timestamp,
+		.period = period,
+	};
+
+	if (binary_output)
+		trace_writer_write(out, buf, trace_encode_sample(buf, &dom->codec, &sample));
+	else
+		trace_writer_printf(out, "#period %"PRIu64" ns\n", period);
+}
+
+static void write_folded_stack(void *opaque, const uint64_t *frames, unsigned int nr_frames,
+		bool complete, uint64_t count) {
+	FILE *f = ((void **)opaque)[0];
+	symbol_index_t *symbol_table = ((void **)opaque)[1];
+	const symbol_t *syms[MAX_STACK_DEPTH];
+	unsigned int i;
+
+	if (symbol_table)
+		symbol_index_lookup_batch(symbol_table, frames, nr_frames, syms);
+
+	// folded stacks go from the root to the leaf, we store them the other way round
+	if (!complete)
+		fprintf(f, "[truncated]%s", nr_frames ? ";" : "");
+	else if (!nr_frames)
+		fprintf(f, "[unknown]");
+	for (i = nr_frames; i-- > 0; ) {
+		if (frames[i] == CCT_IDLE)
+			fprintf(f, "%s", IDLE_FRAME_NAME);
+		else if (symbol_table && syms[i] && syms[i]->addr == frames[i])
+			fprintf(f, "%s", symbol_name(symbol_table, syms[i]));
+		else
+			fprintf(f, "%#"PRIx64, frames[i]);
+		if (i)
+			fputc(';', f);
+	}
+	fprintf(f, " %"PRIu64"\n", count);
+}
+
+/**
+ * Write the aggregated profile to name: all stacks counted so far as folded
+ * stacks, one line per stack, or the calling-context tree. A file is
+ * replaced atomically, so readers always see a complete profile.
+ */
+static int write_profile(const char *name, symbol_index_t *symbol_table) {
+	char tmpname[PATH_MAX];
+	void *ctx[2];
+	FILE *f;
+
+	if (!strcmp(name, "-"))
+		f = stdout;
+	else {
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+		f = fopen(tmpname, "w");
+		if (!f) {
+			fprintf(stderr, "cannot open file %s: %s\n", tmpname, strerror(errno));
+			return -1;
+		}
+	}
+	if (dom->cct) {
+		if (cct_write(dom->cct, f))
+			fprintf(stderr, "cannot write calling-context tree: %s\n", strerror(errno));
+	}
+	else {
+		ctx[0] = f;
+		ctx[1] = symbol_table;
+		stack_agg_foreach(dom->stack_agg, write_folded_stack, ctx);
+	}
+	if (f == stdout) {
+		// separate the folded stacks of several SIGUSR1s
+		if (!dom->cct)
+			fputc('\n', f);
+		fflush(f);
+		return 0;
+	}
+	if (fclose(f) || rename(tmpname, name)) {
+		fprintf(stderr, "cannot write file %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void request_profile_dump(int sig __attribute__((unused))) {
+	profile_dump_requests++;
+}
+
+/**
+ * Count the stack in the aggregation table or calling-context tree. With a
+ * symbol table, frames are reduced to the start of their function first,
+ * so that all samples in the same call chain count towards the same stack.
+ */
+static void aggregate_stack_trace(stack_trace_t *trace, symbol_index_t *symbol_table) {
+	// only ever used by one thread at a time, like the output
+	static guest_word_t frames[MAX_STACK_DEPTH];
+	static const symbol_t *syms[MAX_STACK_DEPTH];
+	unsigned int i;
+
+	if (symbol_table)
+		symbol_index_lookup_batch(symbol_table, trace->frames, trace->nr_frames, syms);
+	for (i = 0; i < trace->nr_frames; i++)
+		frames[i] = symbol_table && syms[i] ? syms[i]->addr : trace->frames[i];
+	// idle vCPUs count towards a stack of their own
+	if (trace->idle) {
+		frames[0] = CCT_IDLE;
+		i = 1;
+	}
+	if (dom->cct ? cct_insert(dom->cct, frames, i, trace->complete) :
+			stack_agg_add(dom->stack_agg, frames, i, trace->complete))
+		fprintf(stderr, "out of memory for aggregated stacks, sample lost\n");
+
+	// do this here rather than in the signal handler, we own the table
+	if (dom->profile_dumps != profile_dump_requests) {
+		dom->profile_dumps = profile_dump_requests;
+		write_profile(dom->outname, symbol_table);
+	}
+}
+
+void print_stack_trace(stack_trace_t *trace, trace_writer_t *out, symbol_index_t *symbol_table) {
+	unsigned int i;
+
+	if (trace->idle && idle_mode == IDLE_SKIP)
+		return;
+	if (optimistic && !trace->idle) {
+		// keep what we could verify, unless that's nothing at all
+		if (!trace->torn)
+			optimistic_accepted++;
+		else if (trace->nr_frames)
+			optimistic_truncated++;
+		else {
+			optimistic_rejected++;
 			return;
 		}
-		if ((fp & PAGE_MASK) != ((fp+wordsize) & PAGE_MASK))
-			hrp = guest_to_host(domid, vcpu, fp+wordsize);
+	}
+	if (dom->stack_agg || dom->cct) {
+		aggregate_stack_trace(trace, symbol_table);
+		return;
+	}
+	if (binary_output) {
+		write_binary_trace(trace, out);
+		return;
+	}
+	if (trace->idle) {
+		trace_writer_printf(out, "%s\n1\n\n", IDLE_FRAME_NAME);
+		return;
+	}
+
+	for (i = 0; i < trace->nr_frames; i++) {
+		if (symbol_table)
+			resolve_and_print_symbol(symbol_table, dom->symbol_memo, trace->frames[i], out);
+		else
+			trace_writer_printf(out, "%#"PRIx64"\n", trace->frames[i]);
+	}
+	// 1 marks a stack walked to its end, 0 one we had to give up on
+	trace_writer_printf(out, "%d\n\n", trace->complete);
+}
+
+static void set_idle_trace(stack_trace_t *trace, unsigned int vcpu) {
+	trace->vcpu = vcpu;
+	trace->nr_frames = 0;
+	trace->complete = true;
+	trace->idle = true;
+	trace->torn = false;
+}
+
+/**
+ * Find out which vCPUs are blocked or offline, so we can skip fetching their
+ * contexts and walking their stacks. Must be called with the domain paused.
+ * If we cannot tell, we treat every vCPU as busy.
+ */
+static void find_idle_vcpus(int domid, unsigned int max_vcpu_id) {
+	unsigned int vcpu;
+
+	if (!dom->vcpu_states)
+		return;
+	if (get_vcpu_states(domid, max_vcpu_id + 1, dom->vcpu_states) < 0) {
+		memset(dom->vcpu_idle, 0, max_vcpu_id + 1);
+		return;
+	}
+	for (vcpu = 0; vcpu <= max_vcpu_id; vcpu++) {
+		dom->vcpu_idle[vcpu] = !(dom->vcpu_states[vcpu] & VCPU_ONLINE) || (dom->vcpu_states[vcpu] & VCPU_BLOCKED);
+		idle_vcpu_samples += dom->vcpu_idle[vcpu];
+	}
+}
+
+/**
+ * Walk the stacks captured for one sample, and write out the traces.
+ * trace is just scratch space for the walks.
+ */
+static void process_snapshots(int domid, unsigned int max_vcpu_id, int wordsize, uint64_t timestamp,
+		stack_snapshot_t *snaps, stack_trace_t *trace, trace_writer_t *out, symbol_index_t *symbol_table) {
+	unsigned int vcpu;
+
+	for (vcpu = 0; vcpu <= max_vcpu_id; vcpu++) {
+		if (snaps[vcpu].idle)
+			set_idle_trace(trace, vcpu);
+		else if (snaps[vcpu].ret < 0) {
+			printf("Failed to get context for VCPU %d, skipping trace. (ret=%d)\n", vcpu, snaps[vcpu].ret);
+			continue;
+		}
 		else
-			hrp = hfp+wordsize;
-		memcpy(&fp, hfp, wordsize);
-		memcpy(&retaddr, hrp, wordsize);
-		DBG("vcpu %d, fp = %#"PRIx64"->%p->%#"PRIx64", return addr = %#"PRIx64"->%p->%#"PRIx64"\n",
-				vcpu, fp, hfp, *((uint64_t*)hfp), fp+wordsize, hrp, retaddr);
+			walk_stack_fp(domid, vcpu, snaps[vcpu].ip, snaps[vcpu].fp, snaps[vcpu].base, wordsize,
+					&snaps[vcpu], trace);
+		trace->timestamp = timestamp;
+		print_stack_trace(trace, out, symbol_table);
+	}
+}
+
+static void *unwind_worker_main(void *arg) {
+	unwind_worker_t *w = arg;
+	sample_t *sample;
+
+	for (;;) {
+		sem_wait(&w->wakeup);
+		while ((sample = sample_ring_peek(sample_ring)) != NULL) {
+			if (sample->period != w->period) {
+				write_rate_change(w->out, sample->timestamp, sample->period);
+				w->period = sample->period;
+			}
+			INSTR_START(output_begin);
+			process_snapshots(w->domid, w->max_vcpu_id, w->wordsize, sample->timestamp,
+					sample->vcpus, &w->trace, w->out, w->symbol_table);
+			INSTR_STOP(INSTR_OUTPUT, output_begin);
+			sample_ring_release(sample_ring);
+		}
+		// only stop once everything queued up to here has been written
+		if (atomic_load(&w->stop))
+			break;
 	}
-	fprintf(file, "1\n\n");
+	return NULL;
+}
+
+/**
+ * Take the sample of one vCPU whose context we just fetched: copy its stack
+ * into snaps if given, or walk it right away. This only touches the vCPU's
+ * own entries, so several vCPUs can be sampled in parallel.
+ */
+static void sample_vcpu(int domid, unsigned int vcpu, int wordsize, stack_snapshot_t *snaps) {
+	if (dom->vcpu_idle && dom->vcpu_idle[vcpu]) {
+		if (snaps)
+			snaps[vcpu].idle = true;
+		else
+			set_idle_trace(&dom->stack_traces[vcpu], vcpu);
+		return;
+	}
+	if (snaps) {
+		snaps[vcpu].idle = false;
+		snaps[vcpu].ret = dom->vcpu_context_rets[vcpu];
+	}
+	else
+		dom->stack_traces[vcpu].idle = false;
+	if (dom->vcpu_context_rets[vcpu] < 0)
+		return;
+	if (snaps)
+		capture_stack(domid, vcpu, &dom->vcpu_contexts[vcpu], &snaps[vcpu]);
+	else
+		walk_stack_fp(domid, vcpu, instruction_pointer(&dom->vcpu_contexts[vcpu]),
+				frame_pointer(&dom->vcpu_contexts[vcpu]), stack_pointer(&dom->vcpu_contexts[vcpu]), wordsize, NULL, &dom->stack_traces[vcpu]);
+}
+
+/* sample vCPUs of the pool's current sample until there are none left */
+static void take_vcpus(walker_pool_t *pool) {
+	unsigned int vcpu;
+
+	while ((vcpu = atomic_fetch_add(&pool->next_vcpu, 1)) <= pool->max_vcpu_id)
+		sample_vcpu(pool->domid, vcpu, pool->wordsize, pool->snaps);
+}
+
+/**
+ * Sample all vCPUs. With walker threads, they take vCPUs in parallel with
+ * us, and we wait until all of them are done. The results end up in each
+ * vCPU's own trace or snapshot, so the output is in vCPU order either way.
+ */
+static void sample_vcpus(int domid, unsigned int max_vcpu_id, int wordsize, stack_snapshot_t *snaps) {
+	unsigned int i;
+
+	if (!walker_pool) {
+		for (i = 0; i <= max_vcpu_id; i++)
+			sample_vcpu(domid, i, wordsize, snaps);
+		return;
+	}
+	walker_pool->domid = domid;
+	walker_pool->max_vcpu_id = max_vcpu_id;
+	walker_pool->wordsize = wordsize;
+	walker_pool->snaps = snaps;
+	atomic_store(&walker_pool->next_vcpu, 0);
+	atomic_store(&walker_pool->done, 0);
+	for (i = 0; i < walker_pool->nr; i++)
+		sem_post(&walker_pool->walkers[i].start);
+	take_vcpus(walker_pool);
+	// the domain is paused while we wait, so don't go to sleep for it
+	while (atomic_load(&walker_pool->done) < walker_pool->nr)
+		;
+}
+
+static void *walker_main(void *arg) {
+	walker_t *w = arg;
+	walker_pool_t *pool = walker_pool;
+	page_cache_t **cache;
+
+	w->ret = xen_interface_open();
+	sem_post(&pool->ready);
+	if (w->ret)
+		return NULL;
+	for (;;) {
+		sem_wait(&w->start);
+		if (atomic_load(&pool->stop))
+			break;
+		// guest addresses only mean something within one domain
+		cache = &dom->walker_caches[w->index];
+		if (!*cache)
+			*cache = page_cache_create(pool->page_cache_capacity);
+		page_cache = *cache;
+		// without a cache, leave the vCPUs to the other threads
+		if (page_cache)
+			take_vcpus(pool);
+		atomic_fetch_add(&pool->done, 1);
+	}
+	xen_interface_close_thread();
+	return NULL;
+}
+
+/**
+ * Start nr walker threads, each with its own hypervisor handles, and a page
+ * cache per domain (see domain_t). They are pinned to the CPUs we may run
+ * on, one each, leaving the first one (or sampler_cpu, if it is set) to the
+ * sampling thread; if there are fewer CPUs than that, the rest are not
+ * pinned.
+ */
+static int start_walkers(unsigned int nr, unsigned int page_cache_capacity, int sampler_cpu) {
+	static int allowed_cpus[CPU_SETSIZE];
+	cpu_set_t allowed, cpus;
+	pthread_attr_t attr;
+	unsigned int i, first = sampler_cpu < 0, nr_cpus = 0;
+	int cpu;
+
+	walker_pool = calloc(1, sizeof(walker_pool_t));
+	if (!walker_pool)
+		return -1;
+	walker_pool->walkers = calloc(nr, sizeof(walker_t));
+	if (!walker_pool->walkers)
+		return -1;
+	walker_pool->page_cache_capacity = page_cache_capacity;
+	atomic_init(&walker_pool->stop, false);
+	if (sem_init(&walker_pool->ready, 0, 0))
+		return -1;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		CPU_ZERO(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && cpu != sampler_cpu)
+			allowed_cpus[nr_cpus++] = cpu;
+	for (i = 0; i < nr; i++) {
+		walker_t *w = &walker_pool->walkers[i];
+
+		cpu = i + first < nr_cpus ? allowed_cpus[i + first] : -1;
+		w->index = i;
+		w->cpu = cpu;
+		if (sem_init(&w->start, 0, 0) || pthread_attr_init(&attr))
+			return -1;
+		if (cpu >= 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		if (pthread_create(&w->thread, &attr, walker_main, w))
+			return -1;
+		pthread_attr_destroy(&attr);
+		walker_pool->nr++;
+		DBG("walker %u pinned to CPU %d\n", i, cpu);
+	}
+	for (i = 0; i < nr; i++)
+		sem_wait(&walker_pool->ready);
+	for (i = 0; i < nr; i++)
+		if (walker_pool->walkers[i].ret)
+			return -1;
+	return 0;
+}
+
+static void stop_walkers(void) {
+	unsigned int i;
+
+	atomic_store(&walker_pool->stop, true);
+	for (i = 0; i < walker_pool->nr; i++)
+		sem_post(&walker_pool->walkers[i].start);
+	for (i = 0; i < walker_pool->nr; i++)
+		pthread_join(walker_pool->walkers[i].thread, NULL);
 }
 
 /**
  * Walk the stack via the frame pointer. Returns 0 on success.
+ * The domain is only paused while we collect the return addresses (or, with
+ * stack snapshots, while we copy the stacks), symbol resolution and output
+ * happen after unpausing it. In deferred mode, the snapshots are handed to
+ * the unwind worker thread instead, and we don't wait for the walk at all.
+ * In optimistic mode, the domain isn't paused at all.
  */
-int do_stack_trace_fp(int domid, unsigned int max_vcpu_id, int wordsize, FILE *file, void *symbol_table) {
+int do_stack_trace_fp(int domid, unsigned int max_vcpu_id, int wordsize, trace_writer_t *out, symbol_index_t *symbol_table) {
 	unsigned int vcpu;
+	uint64_t pause_begin, pause_time;
+	stack_snapshot_t *snaps = dom->stack_snapshots;
+	sample_t *sample = NULL;
 
-	if (pause_domain(domid) < 0) {
+	if (sample_ring) {
+		sample = sample_ring_reserve(sample_ring);
+		if (!sample) {
+			// the worker can't keep up; drop this sample rather than wait for it
+			dropped_samples++;
+			return 0;
+		}
+		snaps = sample->vcpus;
+	}
+
+	pause_begin = sample_timer_now();
+	INSTR_START(phase_begin);
+	if (!optimistic && pause_domain(domid) < 0) {
 		fprintf(stderr, "Could not pause domid %d\n", domid);
 		return -7;
 	}
+	INSTR_STOP(INSTR_PAUSE, phase_begin);
+	INSTR_START(contexts_begin);
+	find_idle_vcpus(domid, max_vcpu_id);
+	// fetch all contexts in one go, that's one trap instead of one per vCPU
+	get_vcpu_contexts(domid, max_vcpu_id + 1, dom->vcpu_idle, dom->vcpu_contexts, dom->vcpu_context_rets);
+	INSTR_STOP(INSTR_CONTEXTS, contexts_begin);
+	INSTR_START(walk_begin);
+	sample_vcpus(domid, max_vcpu_id, wordsize, snaps);
+	INSTR_STOP(INSTR_WALK, walk_begin);
+	if (!optimistic) {
+		INSTR_START(unpause_begin);
+		if (unpause_domain(domid) < 0) {
+			fprintf(stderr, "Could not unpause domid %d\n", domid);
+			return -7;
+		}
+		INSTR_STOP(INSTR_UNPAUSE, unpause_begin);
+		pause_time = sample_timer_now() - pause_begin;
+		dom->last_pause = pause_time;
+		duration_stats_add(&pause_stats, pause_time);
+		if (pause_log)
+			fprintf(pause_log, "%"PRIu64"\n", pause_time);
+	}
+
+	if (sample_ring) {
+		sample->timestamp = pause_begin;
+		sample->period = dom->period;
+		sample_ring_publish(sample_ring);
+		sem_post(&unwind_worker->wakeup);
+		return 0;
+	}
+	INSTR_START(output_begin);
+	if (snaps) {
+		process_snapshots(domid, max_vcpu_id, wordsize, pause_begin, snaps, &dom->stack_traces[0], out, symbol_table);
+		INSTR_STOP(INSTR_OUTPUT, output_begin);
+		return 0;
+	}
 	for (vcpu = 0; vcpu <= max_vcpu_id; vcpu++) {
-		walk_stack_fp(domid, vcpu, wordsize, file, symbol_table);
+		if (!dom->stack_traces[vcpu].idle && dom->vcpu_context_rets[vcpu] < 0) {
+			printf("Failed to get context for VCPU %d, skipping trace. (ret=%d)\n", vcpu, dom->vcpu_context_rets[vcpu]);
+			continue;
+		}
+		dom->stack_traces[vcpu].timestamp = pause_begin;
+		print_stack_trace(&dom->stack_traces[vcpu], out, symbol_table);
 	}
-	if (unpause_domain(domid) < 0) {
-		fprintf(stderr, "Could not unpause domid %d\n", domid);
-		return -7;
+	INSTR_STOP(INSTR_OUTPUT, output_begin);
+	return 0;
+}
+
+/* allocate snapshot buffers of size bytes for nr vCPUs */
+static stack_snapshot_t *alloc_snapshots(unsigned int nr, size_t size) {
+	stack_snapshot_t *snaps;
+	unsigned int i;
+
+	snaps = calloc(nr, sizeof(stack_snapshot_t));
+	if (!snaps)
+		return NULL;
+	for (i = 0; i < nr; i++) {
+		snaps[i].size = size;
+		snaps[i].data = malloc(size);
+		if (!snaps[i].data)
+			return NULL;
 	}
+	return snaps;
+}
+
+static int start_unwind_worker(int domid, unsigned int max_vcpu_id, int wordsize, trace_writer_t *out, symbol_index_t *symbol_table,
+		uint64_t period) {
+	unwind_worker = calloc(1, sizeof(unwind_worker_t));
+	if (!unwind_worker)
+		return -1;
+	unwind_worker->domid = domid;
+	unwind_worker->max_vcpu_id = max_vcpu_id;
+	unwind_worker->wordsize = wordsize;
+	unwind_worker->out = out;
+	unwind_worker->symbol_table = symbol_table;
+	unwind_worker->period = period;
+	atomic_init(&unwind_worker->stop, false);
+	if (sem_init(&unwind_worker->wakeup, 0, 0))
+		return -1;
+	if (pthread_create(&unwind_worker->thread, NULL, unwind_worker_main, unwind_worker))
+		return -1;
 	return 0;
 }
 
+/* let the worker write out everything still queued, then wait for it */
+static void stop_unwind_worker(void) {
+	atomic_store(&unwind_worker->stop, true);
+	sem_post(&unwind_worker->wakeup);
+	pthread_join(unwind_worker->thread, NULL);
+}
+
 
 #ifdef WITH_UNWIND
-void walk_stack_libunwind(struct UXEN_info *ui, unw_addr_space_t as, FILE *file, bool resolve_symbols) {
+/* print the stack with symbols resolved by libunwind from the ELF file */
+void walk_stack_libunwind_resolve(struct UXEN_info *ui, unw_addr_space_t as, trace_writer_t *out) {
 	unw_cursor_t cursor;
 	unw_word_t addr;
 	const unsigned int BUFLEN = 64;
@@ -309,130 +1097,553 @@ void walk_stack_libunwind(struct UXEN_info *ui, unw_addr_space_t as, FILE *file,
 	// our first "return" address is the instruction pointer
 	unw_get_reg(&cursor, UNW_REG_IP, &addr);
 
-	if (resolve_symbols && !unw_get_proc_name(&cursor, buf, BUFLEN, &addr))
-		fprintf(file, "%s+%#"PRIxPTR"\n", buf, addr);
+	if (!unw_get_proc_name(&cursor, buf, BUFLEN, &addr))
+		trace_writer_printf(out, "%s+%#"PRIxPTR"\n", buf, addr);
 	else
-		fprintf(file, "%#"PRIxPTR"\n", addr);
+		trace_writer_printf(out, "%#"PRIxPTR"\n", addr);
 
 	while (unw_step(&cursor) > 0) {
 		unw_get_reg(&cursor, UNW_REG_IP, &addr);
 		if (!addr)
 			break;
-		if (resolve_symbols && !unw_get_proc_name(&cursor, buf, BUFLEN, &addr))
-			fprintf(file, "%s+%#"PRIxPTR"\n", buf, addr);
+		if (!unw_get_proc_name(&cursor, buf, BUFLEN, &addr))
+			trace_writer_printf(out, "%s+%#"PRIxPTR"\n", buf, addr);
 		else
-			fprintf(file, "%#"PRIxPTR"\n", addr);
+			trace_writer_printf(out, "%#"PRIxPTR"\n", addr);
+	}
+	trace_writer_printf(out, "1\n\n");
+}
+
+/* record the return addresses libunwind finds in trace */
+void walk_stack_libunwind(struct UXEN_info *ui, unw_addr_space_t as, stack_trace_t *trace) {
+	unw_cursor_t cursor;
+	unw_word_t addr;
+
+	trace->nr_frames = 0;
+	trace->complete = false;
+	trace->idle = false;
+	trace->torn = false;
+	unw_init_remote(&cursor, as, ui);
+
+	// our first "return" address is the instruction pointer
+	unw_get_reg(&cursor, UNW_REG_IP, &addr);
+	trace->frames[trace->nr_frames++] = addr;
+
+	while (unw_step(&cursor) > 0) {
+		unw_get_reg(&cursor, UNW_REG_IP, &addr);
+		if (!addr)
+			break;
+		if (trace->nr_frames == MAX_STACK_DEPTH)
+			return;
+		trace->frames[trace->nr_frames++] = addr;
 	}
-	fprintf(file, "1\n\n");
+	trace->complete = true;
 }
 
 /**
  * Walk the stack via eh_frame information parsed by libunwind. Returns 0 on success.
  */
-int do_stack_trace_libunwind(int domid, unsigned int max_vcpu_id, FILE *file,
+int do_stack_trace_libunwind(int domid, unsigned int max_vcpu_id, trace_writer_t *out,
 		struct UXEN_info *ui, unw_addr_space_t as, bool resolve_symbols) {
 	unsigned int vcpu;
+	uint64_t pause_begin, pause_time;
 
+	pause_begin = sample_timer_now();
+	INSTR_START(phase_begin);
 	if (pause_domain(domid) < 0) {
 		fprintf(stderr, "Could not pause domid %d\n", domid);
 		return -7;
 	}
+	INSTR_STOP(INSTR_PAUSE, phase_begin);
+	INSTR_START(contexts_begin);
+	find_idle_vcpus(domid, max_vcpu_id);
+	INSTR_STOP(INSTR_CONTEXTS, contexts_begin);
+	// libunwind walks and writes each stack in one go, so that all counts as the walk
+	INSTR_START(walk_begin);
 	for (vcpu = 0; vcpu <= max_vcpu_id; vcpu++) {
-		_UXEN_change_vcpu(ui, vcpu);
-		walk_stack_libunwind(ui, as, file, resolve_symbols);
+		if (dom->vcpu_idle && dom->vcpu_idle[vcpu])
+			set_idle_trace(&dom->stack_traces[vcpu], vcpu);
+		else if (resolve_symbols) {
+			_UXEN_change_vcpu(ui, vcpu);
+			walk_stack_libunwind_resolve(ui, as, out);
+			continue;
+		}
+		else {
+			_UXEN_change_vcpu(ui, vcpu);
+			walk_stack_libunwind(ui, as, &dom->stack_traces[vcpu]);
+			dom->stack_traces[vcpu].vcpu = vcpu;
+		}
+		dom->stack_traces[vcpu].timestamp = pause_begin;
+		print_stack_trace(&dom->stack_traces[vcpu], out, NULL);
 	}
+	INSTR_STOP(INSTR_WALK, walk_begin);
+	INSTR_START(unpause_begin);
 	if (unpause_domain(domid) < 0) {
 		fprintf(stderr, "Could not unpause domid %d\n", domid);
 		return -7;
 	}
+	INSTR_STOP(INSTR_UNPAUSE, unpause_begin);
+	pause_time = sample_timer_now() - pause_begin;
+	dom->last_pause = pause_time;
+	duration_stats_add(&pause_stats, pause_time);
+	if (pause_log)
+		fprintf(pause_log, "%"PRIu64"\n", pause_time);
 	return 0;
 }
 #endif
 
-void *read_symbol_table(char *symbol_table_file_name)
+/* our resident set size in KiB, or 0 if we can't tell */
+static long rss_kib(void)
 {
-	char line[256];
-	char *p, *symbol;
-	size_t len;
-	int count = 0;
+	long pages = 0;
 	FILE *f;
-	int ch, i;
-	void *head;
-	element_t element;
-
-	f = fopen(symbol_table_file_name, "r");
-	if (f == NULL) {
-		fprintf(stderr, "failed to open symbol table file %s, will not resolve symbols!\n",
-				symbol_table_file_name);
-		return NULL;
-	}
 
-	// count number of lines, i.e., elements in the file:
-	while((ch = fgetc(f)) != EOF)
-		if (ch == '\n')
-			count++;
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%*d %ld", &pages) != 1)
+		pages = 0;
+	fclose(f);
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+symbol_index_t *read_symbol_table(char *symbol_table_file_name)
+{
+	uint64_t begin = sample_timer_now(), load_time;
+	long rss = rss_kib();
+	symbol_index_t *head;
+	int err;
 
-	if (count == 0) {
+	head = symbol_index_open(symbol_table_file_name, &err);
+	if (!head && err < 0) {
+		fprintf(stderr, "failed to read symbol table file %s (%s), will not resolve symbols!\n",
+				symbol_table_file_name, strerror(-err));
+		return NULL;
+	}
+	if (!head) {
 		fprintf(stderr, "Symbol table file %s contained no valid entries!\n", symbol_table_file_name);
 		fprintf(stderr, "Disabling symbol resolution.\n");
 		return NULL;
 	}
+	load_time = sample_timer_now() - begin;
+	VERBOSE("symbol table %s: %u symbols (%zu bytes of names)%s, loaded in %"PRIu64".%03"PRIu64" ms, "
+			"RSS %ld KiB (+%ld KiB)\n",
+			symbol_table_file_name, head->filled, head->strings_len,
+			head->map ? " from its cache" : head->cache_written ? ", cache written" : "",
+			load_time / 1000000, load_time / 1000 % 1000, rss_kib(), rss_kib() - rss);
+	return head;
+}
 
-	rewind(f);
-	head = binsearch_alloc(count);
-	if (!head)
-		return NULL;
-	for (i=0; i<count; i++) {
-		if (fgets(line, 256, f) == NULL) {
-			fprintf(stderr, "Error reading entry %d from symbol table file\n", i);
-			goto out_err;
+/* the kernel's text, as far as we can tell: what its text symbols cover */
+static void symbol_table_range(symbol_index_t *symbol_table, guest_word_t *start, guest_word_t *end)
+{
+	*start = symbol_table->text_start;
+	*end = symbol_table->text_end;
+}
+
+void write_file_header(trace_writer_t *out, int domid, int wordsize, unsigned int freq)
+{
+	char timestring[64];
+	unsigned char buf[TRACE_HEADER_SIZE];
+	struct timespec ts;
+	trace_header_t header = {
+		.version = TRACE_VERSION,
+		.word_size = wordsize,
+		.domid = domid,
+		.frequency = freq,
+#if defined(HYPERCALL_XENCALL)
+		.backend = TRACE_BACKEND_XENCALL,
+#else
+		.backend = TRACE_BACKEND_LIBXC,
+#endif
+	};
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (binary_output) {
+		header.start_time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		trace_writer_write(out, buf, trace_encode_header(buf, &header));
+		return;
+	}
+	strftime(timestring, 63, "%Y-%m-%d %H:%M:%S %Z (%z)", localtime(&ts.tv_sec));
+	trace_writer_printf(out, "#unikernel stack tracer using %s hypercall interface\n", HYPERCALL_NAME);
+	trace_writer_printf(out, "#tracing domid %d on %s\n\n", domid, timestring);
+}
+
+/* a symbol table given with -s DOMID:TAB, for that domain only */
+typedef struct {
+	int domid;
+	char *name;
+	bool loaded;
+	symbol_index_t *table;
+} symbol_spec_t;
+
+/* how to set up each domain we profile, from the command line */
+typedef struct {
+	char *outname;
+	bool several;           // write one file per domain, named <outname>.<domid>
+	bool aggregate;
+	bool calling_context;
+	bool deferred;
+	size_t write_buffer_size;
+	unsigned int page_cache_capacity;
+	unsigned int snapshot_kib;
+	unsigned int freq;
+	symbol_spec_t default_symbols;  // -s TAB, for all other domains
+	symbol_spec_t *symbols;
+	unsigned int nr_symbols;
+} domain_config_t;
+
+/* the domains we profile, and those of them with samples left to take */
+static domain_t **domains = NULL;
+static unsigned int nr_domains = 0;
+static domain_t **schedule = NULL;      // a min-heap ordered by deadline
+static unsigned int nr_scheduled = 0;
+static trace_writer_stats_t writer_stats;
+
+static void schedule_push(domain_t *d) {
+	unsigned int i = nr_scheduled++;
+
+	// schedule has room for every domain, see add_domain()
+	while (i > 0 && schedule[(i - 1) / 2]->deadline > d->deadline) {
+		schedule[i] = schedule[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	schedule[i] = d;
+}
+
+static domain_t *schedule_pop(void) {
+	domain_t *top = schedule[0], *last = schedule[--nr_scheduled];
+	unsigned int i = 0, child;
+
+	while ((child = 2 * i + 1) < nr_scheduled) {
+		if (child + 1 < nr_scheduled && schedule[child + 1]->deadline < schedule[child]->deadline)
+			child++;
+		if (last->deadline <= schedule[child]->deadline)
+			break;
+		schedule[i] = schedule[child];
+		i = child;
+	}
+	schedule[i] = last;
+	return top;
+}
+
+static bool known_domain(int domid) {
+	unsigned int i;
+
+	for (i = 0; i < nr_domains; i++)
+		if (domains[i]->domid == domid)
+			return true;
+	return false;
+}
+
+/* the symbol table for domid, loaded on first use */
+static symbol_index_t *domain_symbol_table(domain_config_t *cfg, int domid) {
+	symbol_spec_t *spec = &cfg->default_symbols;
+	unsigned int i;
+
+	for (i = 0; i < cfg->nr_symbols; i++)
+		if (cfg->symbols[i].domid == domid)
+			spec = &cfg->symbols[i];
+	if (!spec->loaded && spec->name)
+		spec->table = read_symbol_table(spec->name);
+	spec->loaded = true;
+	return spec->table;
+}
+
+/**
+ * Write out and free everything we keep for a domain. This does not take
+ * it off the schedule.
+ */
+static void remove_domain(domain_t *d) {
+	trace_writer_stats_t stats;
+	unsigned int i;
+#if defined(HYPERCALL_XENCALL)
+	xlat_stats_t xlat_stats;
+#endif
+
+	dom = d;
+	if (overhead_budget)
+		VERBOSE("governor: changed the sampling rate %u times, ended at %"PRIu64" ns between samples\n",
+				d->rate_changes, d->period);
+	if (d->stack_agg) {
+		write_profile(d->outname, d->symbol_table);
+		VERBOSE("aggregated %llu samples into %zu distinct stacks (%zu frames)\n",
+				d->stack_agg->samples, d->stack_agg->used, d->stack_agg->nr_frames);
+		stack_agg_destroy(d->stack_agg);
+	}
+	else if (d->cct) {
+		write_profile(d->outname, d->symbol_table);
+		VERBOSE("aggregated %llu samples into a calling-context tree of %u nodes\n",
+				d->cct->samples, d->cct->nr_nodes);
+		cct_destroy(d->cct);
+	}
+	else if (d->out) {
+		if (d->symbol_memo && d->symbol_memo->hits + d->symbol_memo->misses)
+			VERBOSE("symbol memo: %llu hits, %llu misses (%.1f%% hit rate)\n",
+					d->symbol_memo->hits, d->symbol_memo->misses, 100.0 * d->symbol_memo->hits /
+					(d->symbol_memo->hits + d->symbol_memo->misses));
+		symbol_memo_destroy(d->symbol_memo);
+		if (trace_writer_close(d->out, &stats))
+			fprintf(stderr, "error writing to %s, trace is incomplete\n", d->outname);
+		writer_stats.bytes_written += stats.bytes_written;
+		writer_stats.writes += stats.writes;
+		writer_stats.stalls += stats.stalls;
+		writer_stats.stall_nsec += stats.stall_nsec;
+	}
+#if defined(HYPERCALL_XENCALL)
+	if (verbose && !xlat_get_stats(d->domid, &xlat_stats)) {
+		printf("translation cache: %llu hits, %llu negative hits, %llu misses, %llu flushes\n",
+				xlat_stats.hits, xlat_stats.negative_hits, xlat_stats.misses, xlat_stats.flushes);
+		printf("page table mappings: %llu hits, %llu misses\n",
+				xlat_stats.table_hits, xlat_stats.table_misses);
+	}
+	xlat_domain_release(d->domid);
+#endif
+	// unmap everything while we still have a handle to do so
+	destroy_page_cache(d->page_cache);
+	if (d->walker_caches)
+		for (i = 0; i < walker_pool->nr; i++)
+			destroy_page_cache(d->walker_caches[i]);
+	if (d->stack_snapshots)
+		for (i = 0; i <= d->max_vcpu_id; i++)
+			free(d->stack_snapshots[i].data);
+	free(d->walker_caches);
+	free(d->stack_snapshots);
+	free(d->vcpu_contexts);
+	free(d->vcpu_context_rets);
+	free(d->stack_traces);
+	free(d->vcpu_states);
+	free(d->vcpu_idle);
+	free(d->outname);
+	free(d);
+	for (i = 0; i < nr_domains; i++)
+		if (domains[i] == d)
+			domains[i] = domains[--nr_domains];
+	dom = NULL;
+}
+
+/**
+ * Set up everything we need to profile domid, and add it to the list of
+ * domains. Returns 0 on success, or the code main() exits with otherwise.
+ * The domain still needs to be put on the schedule.
+ */
+static int add_domain(int domid, domain_config_t *cfg) {
+	domain_t *d, **grown_domains, **grown_schedule;
+	char name[PATH_MAX];
+	int max_vcpu_id, outfd, ret;
+	unsigned int nr;
+
+	d = calloc(1, sizeof(domain_t));
+	// each array keeps its old size until we know it has grown
+	grown_domains = realloc(domains, (nr_domains + 1) * sizeof(domain_t *));
+	if (grown_domains)
+		domains = grown_domains;
+	grown_schedule = realloc(schedule, (nr_domains + 1) * sizeof(domain_t *));
+	if (grown_schedule)
+		schedule = grown_schedule;
+	if (!d || !grown_domains || !grown_schedule) {
+		fprintf(stderr, "Cannot allocate memory for domid %d\n", domid);
+		free(d);
+		return -5;
+	}
+	domains[nr_domains++] = d;
+	d->domid = domid;
+	d->text_start = 1;
+	d->text_end = ~(guest_word_t)0;
+	d->period = d->written_period = 1000000000ULL / cfg->freq;
+
+	d->page_cache = page_cache_create(cfg->page_cache_capacity);
+	if (!d->page_cache) {
+		fprintf(stderr, "Cannot allocate page cache for %u pages\n", cfg->page_cache_capacity);
+		ret = -4;
+		goto err;
+	}
+
+	max_vcpu_id = get_max_vcpu_id(domid);
+	if (max_vcpu_id < 0) {
+		fprintf(stderr, "Could not access information for domid %d. (Does domid %d exist?)\n", domid, domid);
+		ret = -5;
+		goto err;
+	}
+	d->max_vcpu_id = max_vcpu_id;
+	nr = max_vcpu_id + 1;
+
+	d->vcpu_contexts = calloc(nr, sizeof(vcpu_guest_context_transparent_t));
+	d->vcpu_context_rets = calloc(nr, sizeof(int));
+	d->stack_traces = calloc(nr, sizeof(stack_trace_t));
+	if (!d->vcpu_contexts || !d->vcpu_context_rets || !d->stack_traces) {
+		fprintf(stderr, "Cannot allocate memory for %u vCPU contexts\n", nr);
+		ret = -5;
+		goto err;
+	}
+	if (idle_mode != IDLE_WALK) {
+		d->vcpu_states = calloc(nr, 1);
+		d->vcpu_idle = calloc(nr, 1);
+		if (!d->vcpu_states || !d->vcpu_idle) {
+			fprintf(stderr, "Cannot allocate memory for %u vCPU states\n", nr);
+			ret = -5;
+			goto err;
 		}
-		element.key = strtoull(line, &p, 16);
-		// p should now point to the space between address and type
-		// so jump ahead 3 characters to symbol
-		p += 3;
-		len = strlen(p);
-		if (len == 0) {
-			fprintf(stderr, "Error reading entry %d from symbol table file\n", i);
-			goto out_err;
+	}
+	// preallocate everything, so the paused phase is just copying
+	if (cfg->snapshot_kib && !cfg->deferred) {
+		d->stack_snapshots = alloc_snapshots(nr, cfg->snapshot_kib * 1024);
+		if (!d->stack_snapshots) {
+			fprintf(stderr, "Cannot allocate %u KiB stack snapshots for %u vCPUs\n", cfg->snapshot_kib, nr);
+			ret = -5;
+			goto err;
 		}
-		symbol = malloc(len+1);
-		if (!symbol) {
-			fprintf(stderr, "Error allocating %zu bytes of memory for symbol table entry %d!\n", len, i);
-			goto out_err;
+	}
+	if (walker_pool) {
+		d->walker_caches = calloc(walker_pool->nr, sizeof(page_cache_t *));
+		if (!d->walker_caches) {
+			fprintf(stderr, "Cannot allocate memory for domid %d\n", domid);
+			ret = -5;
+			goto err;
 		}
-		else {
-			// don't copy newline
-			strncpy(symbol, p, len-1);
-			element.val.c = symbol;
+	}
+
+	d->wordsize = get_word_size(domid);
+	if (d->wordsize < 0) {
+		fprintf(stderr, "Failed to retrieve word size for domid %d (returned %d)\n", domid, d->wordsize);
+		ret = -6;
+		goto err;
+	}
+	else if ((d->wordsize != 8) && (d->wordsize != 4)) {
+		fprintf(stderr, "Unexpected wordsize (%d) for domid %d, cannot trace.\n", d->wordsize, domid);
+		ret = -6;
+		goto err;
+	}
+	DBG("wordsize is %d\n", d->wordsize);
+
+	d->symbol_table = domain_symbol_table(cfg, domid);
+	if (optimistic && d->symbol_table)
+		symbol_table_range(d->symbol_table, &d->text_start, &d->text_end);
+
+	if (cfg->several)
+		snprintf(name, sizeof(name), "%s.%d", cfg->outname, domid);
+	else
+		snprintf(name, sizeof(name), "%s", cfg->outname);
+	d->outname = strdup(name);
+	if (!d->outname) {
+		fprintf(stderr, "Cannot allocate memory for domid %d\n", domid);
+		ret = -5;
+		goto err;
+	}
+	if (cfg->aggregate) {
+		// the profile is written in one go, see write_profile()
+		if (cfg->calling_context)
+			d->cct = cct_create();
+		else
+			d->stack_agg = stack_agg_create();
+		if (!d->stack_agg && !d->cct) {
+			fprintf(stderr, "cannot allocate stack aggregation table\n");
+			ret = -3;
+			goto err;
 		}
-		binsearch_fill(head, &element);
+		return 0;
 	}
-	if (i != count) {
-		fprintf(stderr, "Error reading symbol table from file, expected %d entries, got %d\n", count, i);
-		goto out_err;
+	if (!strcmp(d->outname, "-")) {
+		// anything we print ourselves should come before the traces
+		fflush(stdout);
+		outfd = STDOUT_FILENO;
 	}
-	return head;
+	else {
+		outfd = open(d->outname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (outfd < 0) {
+			fprintf(stderr, "cannot open file %s: %s\n", d->outname, strerror(errno));
+			ret = -3;
+			goto err;
+		}
+	}
+	d->out = trace_writer_open(outfd, cfg->write_buffer_size, outfd != STDOUT_FILENO);
+	if (!d->out) {
+		fprintf(stderr, "cannot allocate %zu KiB output buffers\n", cfg->write_buffer_size / 1024);
+		if (outfd != STDOUT_FILENO)
+			close(outfd);
+		ret = -3;
+		goto err;
+	}
+	write_file_header(d->out, domid, d->wordsize, cfg->freq);
+	// without a memo, we just look up every frame
+	if (d->symbol_table && !binary_output)
+		d->symbol_memo = symbol_memo_create(SYMBOL_MEMO_DEFAULT_ENTRIES);
+	return 0;
 
-out_err:
-	fprintf(stderr, "Disabling symbol resolution.\n");
-	free(head);
-	return NULL;
+err:
+	remove_domain(d);
+	return ret;
 }
 
-void write_file_header(FILE *f, int domid)
-{
-	char timestring[64];
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
-	strftime(timestring, 63, "%Y-%m-%d %H:%M:%S %Z (%z)", localtime(&ts.tv_sec));
-	fprintf(f, "#unikernel stack tracer using %s hypercall interface\n", HYPERCALL_NAME);
-	fprintf(f, "#tracing domid %d on %s\n\n", domid, timestring);
+/**
+ * Add the domains that came up since we last looked (all but dom0) to the
+ * schedule, with enough samples to last until end. Domains we cannot set
+ * up are skipped with a warning, they may be in the middle of being built.
+ */
+static void find_new_domains(domain_config_t *cfg, uint64_t now, uint64_t end) {
+	static int domids[MAX_DOMAINS];
+	unsigned long long samples = (unsigned long long)(end - now) * cfg->freq / 1000000000ULL;
+	domain_t *d;
+	int i, nr;
+
+	if (!samples)
+		return;
+	nr = get_domain_list(domids, MAX_DOMAINS);
+	if (nr < 0) {
+		fprintf(stderr, "Could not get the list of domains (ret=%d)\n", nr);
+		return;
+	}
+	for (i = 0; i < nr; i++) {
+		if (domids[i] == 0 || known_domain(domids[i]) || domain_shut_down(domids[i]))
+			continue;
+		if (add_domain(domids[i], cfg)) {
+			fprintf(stderr, "skipping domid %d\n", domids[i]);
+			continue;
+		}
+		VERBOSE("profiling domid %d\n", domids[i]);
+		d = domains[nr_domains - 1];
+		d->deadline = now;
+		d->governor_since = now;
+		d->samples_left = samples;
+		schedule_push(d);
+	}
+}
+
+/**
+ * With the governor, adapt the domain's sampling period so that the time
+ * each sample costs the guest (cost, in ns: how long the domain was paused,
+ * or with -O, how long sampling it took) stays within overhead_budget. The
+ * period is only reconsidered every GOVERNOR_INTERVAL_NSEC, and only
+ * changed by more than an eighth, so that the trace doesn't fill up with
+ * rate changes.
+ */
+static void govern_rate(domain_t *d, uint64_t cost, uint64_t now) {
+	uint64_t period;
+
+	d->governor_cost += cost;
+	d->governor_samples++;
+	if (now - d->governor_since < GOVERNOR_INTERVAL_NSEC)
+		return;
+	period = d->governor_cost / d->governor_samples / overhead_budget;
+	if (period < shortest_period)
+		period = shortest_period;
+	if (period > longest_period)
+		period = longest_period;
+	if (period > d->period + d->period / 8 || period < d->period - d->period / 8) {
+		DBG("domid %d: sampling period %"PRIu64" ns -> %"PRIu64" ns\n", d->domid, d->period, period);
+		d->period = period;
+		d->rate_changes++;
+	}
+	d->governor_cost = 0;
+	d->governor_samples = 0;
+	d->governor_since = now;
 }
 
 static void print_usage(char *name) {
 	printf("usage:\n");
-	printf("  %s [options] <outfile> <domid>\n\n", name);
+	printf("  %s [options] <outfile> <domid>[,<domid>...]|all\n\n", name);
+	printf("With more than one domid, or \"all\" (every domain but dom0, including\n");
+	printf("those started while we run), each domain's trace goes to <outfile>.<domid>.\n\n");
 	printf("options:\n");
 	printf("  -F n --frequency=n         Frequency of traces (in per second, default 1)\n");
 	printf("  -T n --time=n              How long to run the tracer (in seconds, default 1)\n");
@@ -441,9 +1652,12 @@ static void print_usage(char *name) {
 	printf("                             or it may treacherously appear to improve it,\n");
 	printf("                             while it actually doesn't (due to timing quirks)\n");
 	printf("  -s TAB --symbol-table=TAB  Resolve stack addresses with symbols from TAB.\n");
-	printf("                             The file is expected to contain information\n");
-	printf("                             formatted like the output of 'nm -n'. Please\n");
-	printf("                             note that this slows down tracing.\n");
+	printf("                             TAB is either the (unstripped) ELF image of\n");
+	printf("                             the kernel, or a file formatted like the output\n");
+	printf("                             of 'nm -n'.\n");
+	printf("  -s DOMID:TAB               Use TAB for domid DOMID only. Can be given\n");
+	printf("                             once per domain, in addition to a plain -s TAB\n");
+	printf("                             for all other domains.\n");
 #ifdef WITH_UNWIND
 	printf("                             -s, -e, and -E are mutually exclusive.\n");
 	printf("  -e ELF --elf-file=ELF      Use libunwind to unwind the stack, using the\n");
@@ -457,24 +1671,118 @@ static void print_usage(char *name) {
 	printf("                             resolve symbols. This requires an unstripped\n");
 	printf("                             binary and is naturally slower than the -e option.\n");
 	printf("                             -s, -e, and -E are mutually exclusive.\n");
+#endif
+	printf("  -C n --page-cache=n        Keep at most n guest pages mapped at any time\n");
+	printf("                             (default %d). When the cache is full, a page\n", PAGE_CACHE_DEFAULT_CAPACITY);
+	printf("                             that wasn't used recently (CLOCK) is unmapped.\n");
+	printf("  -S n --snapshot=n          Copy up to n KiB of each vCPU's stack while the\n");
+	printf("                             domain is paused, and walk the copies after\n");
+	printf("                             unpausing it. This keeps the pauses short, but\n");
+	printf("                             cuts off stacks deeper than n KiB.\n");
+	printf("  -D --deferred              Hand the stack snapshots (see -S, default %d KiB)\n", DEFAULT_SNAPSHOT_KIB);
+	printf("                             to a background thread for unwinding and output,\n");
+	printf("                             so the sampling loop never waits for them. If\n");
+	printf("                             the thread falls behind, samples are dropped.\n");
+	printf("  -Q n --queue=n             Number of samples that can wait for the\n");
+	printf("                             background thread (default %d).\n", DEFAULT_QUEUE_LENGTH);
+	printf("  -B n --write-buffer=n      Size of each of the %d output buffers (in KiB,\n", TRACE_WRITER_NR_BUFFERS);
+	printf("                             default %d). Output is written by a separate\n", TRACE_WRITER_DEFAULT_BUFFER_SIZE / 1024);
+	printf("                             thread, and sampling only waits for it if all\n");
+	printf("                             buffers are full.\n");
+	printf("  -b --binary                Write a compact binary trace instead of text.\n");
+	printf("                             Use symbolize or trace-to-text to read it.\n");
+	printf("                             Cannot be combined with -s or -E.\n");
+	printf("  -A --aggregate             Count identical stacks instead of writing every\n");
+	printf("                             trace, and write them as folded stacks (one line\n");
+	printf("                             per stack, root first, followed by its count) to\n");
+	printf("                             <outfile> at the end of the run, and whenever\n");
+	printf("                             uniprof receives SIGUSR1. With -s, frames are\n");
+	printf("                             reduced to function names.\n");
+	printf("  -G --calling-context       Like -A, but write a calling-context tree (all\n");
+	printf("                             stacks merged from the root down) in a compact\n");
+	printf("                             binary format. Use cct-report to read it.\n");
+	printf("  -I MODE --idle=MODE        What to do with vCPUs that are blocked (idle)\n");
+	printf("                             or offline: \"mark\" them with a %s trace\n", IDLE_FRAME_NAME);
+	printf("                             without walking their stacks (default),\n");
+	printf("                             \"skip\" them altogether, or \"walk\" them like\n");
+	printf("                             any other vCPU.\n");
+	printf("  -j n --walkers=n           Walk the stacks of up to n vCPUs in parallel,\n");
+	printf("                             using n-1 extra threads pinned to separate\n");
+	printf("                             CPUs (default 1, i.e., no extra threads).\n");
+	printf("  -O --optimistic            Don't pause the domain while taking samples.\n");
+	printf("                             Since stacks can change while we walk them,\n");
+	printf("                             walks stop at the first frame that doesn't look\n");
+	printf("                             right (with -s, return addresses must be inside\n");
+	printf("                             the symbol table), and samples without a single\n");
+	printf("                             plausible frame are dropped.\n");
+	printf("  -P FILE --pause-log=FILE   Write the time (in ns) the domain was paused for\n");
+	printf("                             each sample to FILE, one line per sample.\n");
+	printf("  -K MODE --timer=MODE       How to wait for the next sample: \"sleep\" with\n");
+	printf("                             clock_nanosleep() (default) or \"timerfd\" with a\n");
+	printf("                             timerfd, both until shortly before the deadline\n");
+	printf("                             and busy-waiting for the rest, or \"spin\" to\n");
+	printf("                             only busy-wait. Use -v to see how late we wake up.\n");
+	printf("  -R n --realtime=n          Run the sampling thread with SCHED_FIFO priority\n");
+	printf("                             n, and lock uniprof's memory. Needs privileges.\n");
+	printf("  -c n --cpu=n               Pin the sampling thread to CPU n.\n");
+	printf("  -g PCT --overhead=PCT      Adapt the sampling rate so that each domain is\n");
+	printf("                             paused for at most PCT percent of the time (with\n");
+	printf("                             -O, sampling it takes at most that much time).\n");
+	printf("                             -F is the highest rate, and rate changes are\n");
+	printf("                             recorded in the trace. Cannot be combined with\n");
+	printf("                             -A or -G.\n");
+	printf("  -m n --min-frequency=n     With -g, never sample less than n times per\n");
+	printf("                             second (default 1).\n");
+#ifdef WITH_INSTRUMENTATION
+	printf("  -X FILE --phase-log=FILE   Write how long each phase of each sample took,\n");
+	printf("                             and how many hypercalls and mappings it needed,\n");
+	printf("                             to FILE as CSV.\n");
 #endif
 	printf("  -v --verbose               Show some more informational output.\n");
 	printf("  -V --version               Show version information.\n");
 	printf("  -h --help                  Print this help message.\n");
 }
 
+/* Print the number and cost of the calls into the hypervisor, by type.
+ * Only valid after all threads have closed their hypervisor handles. */
+static void xen_call_stats_print(void)
+{
+	xen_call_stats_t stats[XEN_CALL_NR_TYPES];
+	int i;
+
+	xen_call_get_stats(stats);
+	printf("hypervisor calls:\n");
+	for (i = 0; i < XEN_CALL_NR_TYPES; i++) {
+		if (!stats[i].count)
+			continue;
+		printf("  %-18s %10llu calls, %8llu.%03llu ms total, %6llu ns average\n",
+				xen_call_name(i), stats[i].count,
+				stats[i].nsec / 1000000ULL, stats[i].nsec / 1000ULL % 1000ULL,
+				stats[i].nsec / stats[i].count);
+	}
+}
+
 int main(int argc, char **argv) {
-	int domid, ret;
-	FILE *outfile;
-	int max_vcpu_id;
-	int wordsize;
+	int domid, ret = 0;
+	static int domids[MAX_DOMAINS];
+	unsigned int nr_domids = 0;
+	bool all_domains = false;
+	char *p, *end_of_id, *end;
+	unsigned long capacity;
+	domain_t *d;
+	domain_config_t cfg = {
+		.write_buffer_size = TRACE_WRITER_DEFAULT_BUFFER_SIZE,
+		.page_cache_capacity = PAGE_CACHE_DEFAULT_CAPACITY,
+	};
+	symbol_spec_t *specs;
+	struct sigaction sa;
 	const int measure_rounds = 100;
-	struct timespec gettime_overhead, minsleep, sleep;
-	struct timespec begin, end, ts;
+	struct timespec gettime_overhead, minsleep;
+	uint64_t now, begin, end_time, next_scan, wakeup, minsleep_nsec;
 #ifdef WITH_UNWIND
-	static const char *sopts = "hF:T:Ms:e:E:vV";
+	static const char *sopts = "hF:T:Ms:e:E:C:S:DQ:B:bAGI:j:OP:K:R:c:g:m:X:vV";
 #else
-	static const char *sopts = "hF:T:Ms:vV";
+	static const char *sopts = "hF:T:Ms:C:S:DQ:B:bAGI:j:OP:K:R:c:g:m:X:vV";
 #endif
 	static const struct option lopts[] = {
 		{"help",             no_argument,       NULL, 'h'},
@@ -485,13 +1793,32 @@ int main(int argc, char **argv) {
 #ifdef WITH_UNWIND
 		{"elf-file",         required_argument, NULL, 'e'},
 		{"elf-resolve",      required_argument, NULL, 'E'},
+#endif
+		{"page-cache",       required_argument, NULL, 'C'},
+		{"snapshot",         required_argument, NULL, 'S'},
+		{"deferred",         no_argument,       NULL, 'D'},
+		{"queue",            required_argument, NULL, 'Q'},
+		{"write-buffer",     required_argument, NULL, 'B'},
+		{"binary",           no_argument,       NULL, 'b'},
+		{"aggregate",        no_argument,       NULL, 'A'},
+		{"calling-context",  no_argument,       NULL, 'G'},
+		{"idle",             required_argument, NULL, 'I'},
+		{"walkers",          required_argument, NULL, 'j'},
+		{"optimistic",       no_argument,       NULL, 'O'},
+		{"pause-log",        required_argument, NULL, 'P'},
+		{"timer",            required_argument, NULL, 'K'},
+		{"realtime",         required_argument, NULL, 'R'},
+		{"cpu",              required_argument, NULL, 'c'},
+		{"overhead",         required_argument, NULL, 'g'},
+		{"min-frequency",    required_argument, NULL, 'm'},
+#ifdef WITH_INSTRUMENTATION
+		{"phase-log",        required_argument, NULL, 'X'},
 #endif
 		{"verbose",          no_argument,       NULL, 'v'},
 		{"version",          no_argument,       NULL, 'V'},
 		{0, 0, 0, 0}
 	};
 	char *resolver_file_name = NULL;
-	void *symbol_table = NULL;
 #ifdef WITH_UNWIND
 	struct UXEN_info *ui = NULL;
 	unw_addr_space_t as = NULL;
@@ -499,12 +1826,22 @@ int main(int argc, char **argv) {
 	bool resolver_is_elf = false;
 	bool resolve_symbols_from_elf = false;
 #endif
-	char *exename, *outname;
+	char *exename;
 	int opt;
 	unsigned int freq = 1;
 	unsigned int time = 1;
+	unsigned int snapshot_kib = 0;
+	bool deferred = false;
+	unsigned int queue_length = DEFAULT_QUEUE_LENGTH;
+	unsigned int nr_walkers = 1;
+	char *pause_log_name = NULL;
+	sample_timer_mode_t timer_mode = SAMPLE_TIMER_SLEEP;
+	sample_timer_t timer;
+	static latency_hist_t lateness_hist, work_hist;
+	int rt_priority = 0, sampler_cpu = -1;
+	unsigned int min_freq = 0;
 	bool warn_missed_deadlines = false;
-	unsigned int i,j;
+	unsigned int i;
 	unsigned long long missed_deadlines = 0;
 
 	while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
@@ -522,6 +1859,18 @@ int main(int argc, char **argv) {
 				warn_missed_deadlines = true;
 				break;
 			case 's':
+				// DOMID:TAB only applies to that domain
+				domid = strtol(optarg, &end_of_id, 10);
+				if (end_of_id != optarg && *end_of_id == ':') {
+					specs = realloc(cfg.symbols, (cfg.nr_symbols + 1) * sizeof(symbol_spec_t));
+					if (!specs) {
+						fprintf(stderr, "cannot allocate memory for symbol table %s\n", optarg);
+						return -1;
+					}
+					cfg.symbols = specs;
+					cfg.symbols[cfg.nr_symbols++] = (symbol_spec_t) { .domid = domid, .name = end_of_id + 1 };
+					break;
+				}
 				resolver_file_name = optarg;
 #ifdef WITH_UNWIND
 				if (have_seE) {
@@ -543,6 +1892,123 @@ int main(int argc, char **argv) {
 				resolver_is_elf = true;
 #endif
 				break;
+			case 'C':
+				errno = 0;
+				capacity = strtoul(optarg, &end, 10);
+				if (errno || end == optarg || *end || capacity == 0 || capacity > PAGE_CACHE_MAX_CAPACITY) {
+					fprintf(stderr, "page cache needs to hold between 1 and %u pages\n",
+							PAGE_CACHE_MAX_CAPACITY);
+					return -1;
+				}
+				cfg.page_cache_capacity = capacity;
+				break;
+			case 'S':
+				snapshot_kib = strtoul(optarg, NULL, 10);
+				break;
+			case 'D':
+				deferred = true;
+				break;
+			case 'Q':
+				queue_length = strtoul(optarg, NULL, 10);
+				if (queue_length == 0) {
+					fprintf(stderr, "queue needs to hold at least one sample\n");
+					return -1;
+				}
+				break;
+			case 'B':
+				cfg.write_buffer_size = strtoul(optarg, NULL, 10) * 1024;
+				if (cfg.write_buffer_size == 0) {
+					fprintf(stderr, "output buffers need to be at least 1 KiB\n");
+					return -1;
+				}
+				break;
+			case 'b':
+				binary_output = true;
+				break;
+			case 'I':
+				if (!strcmp(optarg, "mark"))
+					idle_mode = IDLE_MARK;
+				else if (!strcmp(optarg, "skip"))
+					idle_mode = IDLE_SKIP;
+				else if (!strcmp(optarg, "walk"))
+					idle_mode = IDLE_WALK;
+				else {
+					fprintf(stderr, "unknown idle mode %s, expected mark, skip, or walk\n", optarg);
+					return -1;
+				}
+				break;
+			case 'j':
+				nr_walkers = strtoul(optarg, NULL, 10);
+				if (nr_walkers == 0) {
+					fprintf(stderr, "need at least one thread to walk stacks\n");
+					return -1;
+				}
+				break;
+			case 'O':
+				optimistic = true;
+				break;
+			case 'G':
+				cfg.calling_context = true;
+				// fallthrough
+			case 'A':
+				cfg.aggregate = true;
+				break;
+			case 'P':
+				pause_log_name = optarg;
+				break;
+			case 'K':
+				if (!strcmp(optarg, "sleep"))
+					timer_mode = SAMPLE_TIMER_SLEEP;
+				else if (!strcmp(optarg, "timerfd"))
+					timer_mode = SAMPLE_TIMER_TIMERFD;
+				else if (!strcmp(optarg, "spin"))
+					timer_mode = SAMPLE_TIMER_SPIN;
+				else {
+					fprintf(stderr, "unknown timer %s, expected sleep, timerfd, or spin\n", optarg);
+					return -1;
+				}
+				break;
+			case 'R':
+				rt_priority = strtol(optarg, NULL, 10);
+				if (rt_priority < sched_get_priority_min(SCHED_FIFO) || rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+					fprintf(stderr, "SCHED_FIFO priority needs to be between %d and %d\n",
+							sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+					return -1;
+				}
+				break;
+			case 'g':
+				overhead_budget = strtod(optarg, NULL) / 100;
+				if (overhead_budget <= 0 || overhead_budget > 1) {
+					fprintf(stderr, "overhead needs to be more than 0 and at most 100 percent\n");
+					return -1;
+				}
+				break;
+			case 'm':
+				min_freq = strtoul(optarg, NULL, 10);
+				if (min_freq == 0) {
+					fprintf(stderr, "minimum frequency needs to be at least 1\n");
+					return -1;
+				}
+				break;
+#ifdef WITH_INSTRUMENTATION
+			case 'X':
+				if (instr_open_csv(optarg)) {
+					fprintf(stderr, "cannot open file %s: %s\n", optarg, strerror(errno));
+					return -3;
+				}
+				break;
+#else
+			case 'X':
+				fprintf(stderr, "-X needs uniprof to be built with --enable-instrumentation\n");
+				return -1;
+#endif
+			case 'c':
+				sampler_cpu = strtol(optarg, NULL, 10);
+				if (sampler_cpu < 0 || sampler_cpu >= CPU_SETSIZE) {
+					fprintf(stderr, "invalid CPU %s\n", optarg);
+					return -1;
+				}
+				break;
 			case 'v':
 				verbose = true;
 				break;
@@ -555,29 +2021,113 @@ int main(int argc, char **argv) {
 				return -1;
 		}
 	}
-	sleep.tv_sec = 0; sleep.tv_nsec = (1000000000/freq);
+#ifdef WITH_UNWIND
+	if (resolver_is_elf && (snapshot_kib || deferred || optimistic || nr_walkers > 1)) {
+		printf("-S, -D, -j, and -O only work with frame pointer stack walks, not with -e or -E.\n");
+		return -1;
+	}
+#endif
+	if (overhead_budget && cfg.aggregate) {
+		printf("-g changes the sampling rate, which -A and -G cannot record.\n");
+		return -1;
+	}
+	if (min_freq && !overhead_budget) {
+		printf("-m only works with -g.\n");
+		return -1;
+	}
+	if (min_freq > freq) {
+		printf("The minimum frequency (-m) cannot be above the frequency (-F).\n");
+		return -1;
+	}
+	if (overhead_budget) {
+		shortest_period = 1000000000ULL / freq;
+		longest_period = 1000000000ULL / (min_freq ? min_freq : 1);
+	}
+	if (cfg.aggregate && binary_output) {
+		printf("-A/-G and -b are mutually exclusive.\n");
+		return -1;
+	}
+#ifdef WITH_UNWIND
+	if (resolver_is_elf && cfg.nr_symbols) {
+		printf("-s, -e, and -E are mutually exclusive.\n");
+		return -1;
+	}
+	if (cfg.aggregate && resolve_symbols_from_elf) {
+		printf("-A and -G cannot be combined with -E, use -e instead.\n");
+		return -1;
+	}
+	if (binary_output && resolve_symbols_from_elf) {
+		printf("-b stores raw addresses, use -e instead of -E.\n");
+		return -1;
+	}
+	if (binary_output && ((resolver_file_name && !resolver_is_elf) || cfg.nr_symbols)) {
+#else
+	if (binary_output && (resolver_file_name || cfg.nr_symbols)) {
+#endif
+		printf("-b stores raw addresses, resolve them with symbolize instead of -s.\n");
+		return -1;
+	}
+#ifdef WITH_UNWIND
+	if (!resolver_is_elf)
+#endif
+		cfg.default_symbols.name = resolver_file_name;
+	if (deferred && !snapshot_kib)
+		snapshot_kib = DEFAULT_SNAPSHOT_KIB;
+	cfg.snapshot_kib = snapshot_kib;
+	cfg.deferred = deferred;
+	cfg.freq = freq;
 	exename = argv[0];
 	argv += optind; argc -= optind;
-	outname = argv[0];
 
 	if (argc < 2 || argc > 3) {
 		print_usage(exename);
 		return -1;
 	}
+	cfg.outname = argv[0];
 
-	domid = strtol(argv[1], NULL, 10);
-	if (domid == 0) {
-		fprintf(stderr, "invalid domid (unparseable domid string %s, or cannot trace dom0)\n", argv[1]);
-		return -2;
+	if (!strcmp(argv[1], "all"))
+		all_domains = true;
+	else {
+		for (p = argv[1]; *p; p = end_of_id + (*end_of_id == ',')) {
+			domid = strtol(p, &end_of_id, 10);
+			if (domid <= 0 || end_of_id == p || (*end_of_id && *end_of_id != ',')) {
+				fprintf(stderr, "invalid domid (unparseable domid string %s, or cannot trace dom0)\n", argv[1]);
+				return -2;
+			}
+			if (nr_domids == MAX_DOMAINS) {
+				fprintf(stderr, "cannot trace more than %d domains\n", MAX_DOMAINS);
+				return -2;
+			}
+			domids[nr_domids++] = domid;
+		}
 	}
+	cfg.several = all_domains || nr_domids > 1;
+	if (cfg.several && !strcmp(cfg.outname, "-")) {
+		printf("With several domains, <outfile> is the prefix of one file per domain, it cannot be -.\n");
+		return -1;
+	}
+	if (cfg.several && deferred) {
+		printf("-D only works with a single domain.\n");
+		return -1;
+	}
+#ifdef WITH_UNWIND
+	if (cfg.several && resolver_is_elf) {
+		printf("-e and -E only work with a single domain.\n");
+		return -1;
+	}
+#endif
 
-	if ((strlen(outname) == 1) && (!(strncmp(outname, "-", 1)))) {
-		outfile = stdout;
+	if (cfg.aggregate) {
+		sa.sa_handler = request_profile_dump;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
 	}
-	else {
-		outfile = fopen(outname, "w");
-		if (!outfile) {
-			fprintf(stderr, "cannot open file %s: %s\n", outname, strerror(errno));
+
+	if (pause_log_name) {
+		pause_log = fopen(pause_log_name, "w");
+		if (!pause_log) {
+			fprintf(stderr, "cannot open file %s: %s\n", pause_log_name, strerror(errno));
 			return -3;
 		}
 	}
@@ -587,93 +2137,209 @@ int main(int argc, char **argv) {
 		return -4;
 	}
 
-	max_vcpu_id = get_max_vcpu_id(domid);
-	if (max_vcpu_id < 0) {
-		fprintf(stderr, "Could not access information for domid %d. (Does domid %d exist?)\n", domid, domid);
-		return -5;
+	// domains set up their page caches for the walkers, so start those first
+	if (nr_walkers > 1 && start_walkers(nr_walkers - 1, cfg.page_cache_capacity, sampler_cpu)) {
+		fprintf(stderr, "Cannot start %u stack walker threads\n", nr_walkers - 1);
+		return -9;
 	}
-
-	wordsize = get_word_size(domid);
-	if (wordsize < 0) {
-		fprintf(stderr, "Failed to retrieve word size for domid %d (returned %d)\n", domid, wordsize);
-		return -6;
+	for (i = 0; i < nr_domids; i++) {
+		ret = add_domain(domids[i], &cfg);
+		if (ret)
+			return ret;
 	}
-	else if ((wordsize != 8) && (wordsize != 4)) {
-		fprintf(stderr, "Unexpected wordsize (%d) for domid %d, cannot trace.\n", wordsize, domid);
-		return -6;
+	dom = nr_domains ? domains[0] : NULL;
+	if (deferred) {
+		// preallocate everything, so the paused phase is just copying
+		sample_ring = sample_ring_create(queue_length, sizeof(sample_t));
+		if (!sample_ring) {
+			fprintf(stderr, "Cannot allocate queue for %u samples\n", queue_length);
+			return -5;
+		}
+		for (i = 0; i < sample_ring->nr_slots; i++) {
+			sample_t *sample = sample_ring_slot(sample_ring, i);
+			sample->vcpus = alloc_snapshots(dom->max_vcpu_id + 1, snapshot_kib * 1024);
+			if (!sample->vcpus) {
+				fprintf(stderr, "Cannot allocate %u KiB stack snapshots for %d vCPUs\n", snapshot_kib, dom->max_vcpu_id + 1);
+				return -5;
+			}
+		}
 	}
-	DBG("wordsize is %d\n", wordsize);
 
 #ifdef WITH_UNWIND
 	if (resolver_is_elf) {
 		// this implies the ELF file name is set
-		ui = _UXEN_create(domid, 0, resolver_file_name);
+		ui = _UXEN_create(dom->domid, 0, resolver_file_name);
 		if (!ui) {
 			fprintf(stderr, "Cannot read elf file %s. File unreadable or invalid!\n", resolver_file_name);
 			return -7;
 		}
 		as = unw_create_addr_space(&_UXEN_accessors, 0);
 	}
-	else
 #endif
-		if (resolver_file_name) {
-			symbol_table = read_symbol_table(resolver_file_name);
-		}
+	if (optimistic && !cfg.default_symbols.name && !cfg.nr_symbols)
+		fprintf(stderr, "warning: without a symbol table, -O cannot check return addresses\n");
 
-	// Initialization stuff: write file header, measure overhead of clock_gettime/minimal sleeptime, etc.
-	write_file_header(outfile, domid);
+	// Initialization stuff: measure overhead of clock_gettime/minimal sleeptime, etc.
 	measure_overheads(&gettime_overhead, &minsleep, measure_rounds);
 	DBG("gettime overhead is %ld.%09ld, minimal nanosleep() sleep time is %ld.%09ld\n",
 		gettime_overhead.tv_sec, gettime_overhead.tv_nsec, minsleep.tv_sec, minsleep.tv_nsec);
+	minsleep_nsec = (uint64_t)minsleep.tv_sec * 1000000000ULL + minsleep.tv_nsec;
+	// sleep can't reliably wake us up closer to the deadline than that, so spin for the rest
+	if (sample_timer_init(&timer, timer_mode, minsleep_nsec)) {
+		fprintf(stderr, "Cannot create timer: %s\n", strerror(errno));
+		return -10;
+	}
 
-	// The actual stack tracing loop
-	for (i = 0; i < time; i++) {
-		// is the domain done and just hanging around for our sake?
-		if (domain_shut_down(domid)) {
-			return -8;
+	if (sample_ring && start_unwind_worker(dom->domid, dom->max_vcpu_id, dom->wordsize, dom->out, dom->symbol_table,
+				dom->written_period)) {
+		fprintf(stderr, "Cannot start unwind thread\n");
+		return -9;
+	}
+	// only now, so that none of the other threads inherit this
+	if (sampler_cpu >= 0 && sample_timer_pin(sampler_cpu)) {
+		fprintf(stderr, "Cannot pin the sampling thread to CPU %d: %s\n", sampler_cpu, strerror(errno));
+		return -10;
+	}
+	if (rt_priority && sample_timer_realtime(rt_priority)) {
+		fprintf(stderr, "Cannot switch to SCHED_FIFO and lock memory: %s\n", strerror(errno));
+		return -10;
+	}
+
+	/* The actual stack tracing loop: always sample the domain whose deadline
+	 * comes first. Every domain takes a sample every period ns (freq per
+	 * second, unless the governor changes it), on a fixed grid of deadlines,
+	 * so that late wake-ups don't add up. */
+	now = sample_timer_now();
+	end_time = now + (uint64_t)time * 1000000000ULL;
+	next_scan = now;
+	for (i = 0; i < nr_domains; i++) {
+		domains[i]->deadline = now;
+		domains[i]->governor_since = now;
+		domains[i]->samples_left = (unsigned long long)time * freq;
+		if (domains[i]->samples_left)
+			schedule_push(domains[i]);
+	}
+	while (nr_scheduled || (all_domains && now < end_time)) {
+		if (all_domains && now >= next_scan) {
+			find_new_domains(&cfg, now, end_time);
+			next_scan += 1000000000ULL;
+		}
+		// sleep until the next deadline, or the next time we look for new domains
+		wakeup = nr_scheduled ? schedule[0]->deadline : next_scan;
+		if (all_domains && next_scan < wakeup)
+			wakeup = next_scan;
+		now = sample_timer_wait(&timer, wakeup);
+		if (!nr_scheduled || schedule[0]->deadline > now)
+			continue;
+
+		d = schedule_pop();
+		// is the domain done and just hanging around for our sake? check once a second
+		if (now >= d->shutdown_check && domain_shut_down(d->domid)) {
+			if (!cfg.several) {
+				ret = -8;
+				goto out;
+			}
+			VERBOSE("domid %d shut down, no longer profiling it\n", d->domid);
+			remove_domain(d);
+			if (!all_domains)
+				ret = -8;
+			continue;
+		}
+		if (now >= d->shutdown_check)
+			d->shutdown_check = now + 1000000000ULL;
+		dom = d;
+		page_cache = d->page_cache;
+		begin = sample_timer_now();
+		latency_hist_add(&lateness_hist, begin - d->deadline);
+		// with -D, the unwind thread does this, in order with the samples
+		if (d->out && !sample_ring && d->period != d->written_period) {
+			write_rate_change(d->out, begin, d->period);
+			d->written_period = d->period;
 		}
-		for (j = 0; j < freq; j++) {
-			clock_gettime(CLOCK_MONOTONIC, &begin);
 #ifdef WITH_UNWIND
-			if (resolver_is_elf)
-				ret = do_stack_trace_libunwind(domid, max_vcpu_id, outfile, ui, as, resolve_symbols_from_elf);
-			else
+		if (resolver_is_elf)
+			ret = do_stack_trace_libunwind(d->domid, d->max_vcpu_id, d->out, ui, as, resolve_symbols_from_elf);
+		else
 #endif
-				ret = do_stack_trace_fp(domid, max_vcpu_id, wordsize, outfile, symbol_table);
-			if (ret) {
-				return ret;
-			}
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			timespecadd(&begin, &sleep, &ts);
-			if (timespeccmp(&ts, &end, <)) {
-				missed_deadlines++;
-				// don't sleep, but warn if --missed-deadlines is set
-				if (warn_missed_deadlines) {
-					timespecsub(&ts, &end, &ts);
-					timespecnegtopos(&ts, &ts);
-					fprintf(stderr, "we're falling behind by %ld.%09ld!\n", ts.tv_sec, ts.tv_nsec);
-				}
-			}
-			else if ( (i < (time-1)) || (j < (freq-1)) )  {
-				// only sleep if it's not the very last round
-				timespecsub(&ts, &end, &ts);
-				if (timespeccmp(&ts, &minsleep, <)) {
-					// we finished so close to the next deadline that nanosleep() cannot
-					// reliably wake us up in time, so do busywaiting
-					busywait(ts.tv_nsec);
-				}
-				else {
-					nanosleep(&ts, NULL);
-				}
+			ret = do_stack_trace_fp(d->domid, d->max_vcpu_id, d->wordsize, d->out, d->symbol_table);
+		if (ret) {
+			// a domain can go away between two checks, that's no reason to stop
+			if (cfg.several && domain_shut_down(d->domid)) {
+				VERBOSE("domid %d went away, no longer profiling it\n", d->domid);
+				remove_domain(d);
+				ret = all_domains ? 0 : -8;
+				continue;
 			}
+			goto out;
+		}
+		now = sample_timer_now();
+		latency_hist_add(&work_hist, now - begin);
+#ifdef WITH_INSTRUMENTATION
+		instr_end_sample(d->domid, begin);
+#endif
+		d->samples++;
+		if (overhead_budget)
+			govern_rate(d, optimistic ? now - begin : d->last_pause, now);
+		d->deadline += d->period;
+		if (d->deadline < now) {
+			missed_deadlines++;
+			// don't sleep, but warn if --missed-deadlines is set
+			if (warn_missed_deadlines)
+				fprintf(stderr, "we're falling behind by %"PRIu64".%09"PRIu64"!\n",
+						(now - d->deadline) / 1000000000, (now - d->deadline) % 1000000000);
+			// start over from here rather than catching up with a burst of samples
+			d->deadline = now;
 		}
+		// with the governor, samples_left is just an upper bound
+		if (--d->samples_left && (!overhead_budget || d->deadline < end_time))
+			schedule_push(d);
 	}
 
+out:
+	// write out whatever is still queued before we tear anything down
+	if (sample_ring)
+		stop_unwind_worker();
+	if (walker_pool)
+		stop_walkers();
+	while (nr_domains) {
+		if (cfg.several)
+			VERBOSE("domid %d:\n", domains[0]->domid);
+		remove_domain(domains[0]);
+	}
+
+	sample_timer_destroy(&timer);
+	if (verbose) {
+		duration_stats_print("domain paused per sample", &pause_stats);
+		latency_hist_print(stdout, "wake-up lateness", &lateness_hist);
+		latency_hist_print(stdout, "time per sample", &work_hist);
+	}
+#ifdef WITH_INSTRUMENTATION
+	instr_finish(stdout);
+#endif
+	if (!cfg.aggregate)
+		VERBOSE("output: %llu bytes in %llu writes, waited %llu times for the disk (%llu.%09llu s)\n",
+				writer_stats.bytes_written, writer_stats.writes, writer_stats.stalls,
+				writer_stats.stall_nsec / 1000000000ULL, writer_stats.stall_nsec % 1000000000ULL);
+	if (idle_mode != IDLE_WALK)
+		VERBOSE("skipped %llu stack walks of idle or offline vCPUs\n", idle_vcpu_samples);
+	VERBOSE("page cache: %llu hits, %llu misses, %llu evictions\n",
+			thread_stats.cache_hits, thread_stats.cache_misses, thread_stats.cache_evictions);
+
 	if (xen_interface_close())
 		printf("error closing interface to hypervisor. (?!)\n");
+	if (verbose)
+		xen_call_stats_print();
 
 	if (missed_deadlines)
 		printf("Missed %lld deadlines\n", missed_deadlines);
+	if (dropped_samples)
+		printf("Dropped %llu samples, the unwind thread could not keep up\n", dropped_samples);
+	if (optimistic)
+		printf("Optimistic samples: %llu accepted, %llu truncated, %llu rejected as torn\n",
+				optimistic_accepted, optimistic_truncated, optimistic_rejected);
 
-	return 0;
+	if (pause_log)
+		fclose(pause_log);
+
+	return ret;
 }
@@ -36,6 +36,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include "xen-interface.h"
+#include "page-walk.h"
 
 /* On x86, we might have 32-bit domains running on 64-bit machines,
  * so we ask the hypervisor. On ARM, we simply return arch size. */
@@ -48,120 +49,158 @@ int get_word_size(int __maybe_unused domid) {
 }
 
 #if defined(HYPERCALL_XENCALL)
-unsigned long xen_translate_foreign_address(int domid, int vcpu, unsigned long long virt)
+/* TTBCR/TCR_EL1 fields, see ARMv7 ARM B4.1.153 and ARMv8 ARM D7.2.84 */
+#define TTBCR_EAE        (1U<<31)
+#define TTBCR_N(t)       ((t) & 0x7)
+#define TTBCR_T0SZ(t)    ((t) & 0x7)
+#define TTBCR_T1SZ(t)    (((t) >> 16) & 0x7)
+#define TCR_T0SZ(t)      ((t) & 0x3f)
+#define TCR_T1SZ(t)      (((t) >> 16) & 0x3f)
+#define TCR_TG0(t)       (((t) >> 14) & 0x3)
+#define TCR_TG1(t)       (((t) >> 30) & 0x3)
+#define TCR_TG0_4K       0x0
+#define TCR_TG1_4K       0x2
+/* TTBRx base address, without ASID (and CnP) bits */
+#define TTBR_LONG_BADDR  0x0000FFFFFFFFFFE0ULL
+
+uint64_t xlat_context_root(vcpu_guest_context_t *ctx)
+{
+	return ctx->ttbr0;
+}
+
+static void *map_table(void *opaque, uint64_t pfn)
+{
+	return xlat_map_table(opaque, pfn);
+}
+
+/* Pick the page table that translates virt. Sets *root to the TTBR value
+ * (which is what translations are cached under) and *table_addr to the
+ * address of the table itself. Returns the size of the input address range
+ * for long-descriptor tables, 32 for short-descriptor tables (*long_desc
+ * tells which), or 0 if we can't walk the tables. */
+static int select_table(vcpu_guest_context_t *ctx, uint64_t virt, uint64_t *root,
+		uint64_t *table_addr, int *long_desc)
 {
-	vcpu_guest_context_t ctx;
-	uint32_t pt_base_addr;
-	int arm_pt_base_length = 18;
-	int arm_pt_index_length = 12;
-	uint32_t addr, offset;
-	unsigned int N; /* N as defined in the the ARM TCBR specification */
-	int err, entry_type;
-	void *map;
-
-	get_vcpu_context(domid, vcpu, &ctx);
-	/* N defines the split between the two page tables. If all the most-significant
-	 * N bits of a virtual address are 0, then use page table 0, otherwise use
-	 * page table 1. */
-	N = ctx.ttbcr & 0x7;
-	if (virt & (N<<29)) {
-		fprintf(stderr, "warning: TTBR1 support not tested at all!\n");
-		pt_base_addr = ctx.ttbr1 & ~((1<<(32-arm_pt_base_length))-1);
+	int va_bits;
+#if defined(__aarch64__)
+	/* AArch64: bit 55 of the address selects between TTBR0_EL1 and
+	 * TTBR1_EL1, TCR_EL1.TxSZ gives the size of the respective range. */
+	*long_desc = 1;
+	if (virt & (1ULL<<55)) {
+		if (TCR_TG1(ctx->ttbcr) != TCR_TG1_4K)
+			goto out_granule;
+		*root = ctx->ttbr1;
+		va_bits = 64 - TCR_T1SZ(ctx->ttbcr);
 	}
 	else {
-		/* Update translate base and table index width from their
-		 * default values according to N. */
-		arm_pt_base_length += N;
-		arm_pt_index_length -= N;
-		pt_base_addr = ctx.ttbr0 & ~((1<<(32-arm_pt_base_length))-1);
+		if (TCR_TG0(ctx->ttbcr) != TCR_TG0_4K)
+			goto out_granule;
+		*root = ctx->ttbr0;
+		va_bits = 64 - TCR_T0SZ(ctx->ttbcr);
 	}
-	addr = pt_base_addr>>PAGE_SHIFT;
-	map = xenforeignmemory_map(fmemh, domid, PROT_READ, 1, (xen_pfn_t *)&addr, &err);
-	if (err)
-		goto out_unmap;
-	DBG("mapped page table base 0x%x to %p, err = %d\n", pt_base_addr, map, err);
-
-	/* See ARMv7 Reference Manual, Figure B3-9, or B3-10 on how to get a first-level
-	 * descriptor address:
-	 * We take bits 31 to (14-N) from TTBR0 (i.e., pt_base_addr) and map them to 31..(14-N).
-	 * We then take bits (31-N) to 20 from the virtual address and map them to (13-N)..2.
-	 * Bits 1..0 are 0x0. */
-	addr = (virt & (~((1<<arm_pt_index_length)-1))) >> 20;
-	DBG("PT virt part is 0x%x\n", addr);
-	addr = pt_base_addr + (addr<<2);
-	offset = addr - pt_base_addr;
-	DBG("address-to-lookup is 0x%x, offset to base is 0x%x\n", addr, addr-pt_base_addr);
-
-	memcpy(&addr, map + offset, 4);
-	DBG("content of %p is 0x%x\n", map + offset, addr);
-
-	/* we now have to check which type of table entry this is */
-	entry_type = addr & 0x3;
-	DBG("entry type is 0x%x\n", entry_type);
-	switch (entry_type) {
-		case 0x0:
-			/* page fault. Should never happen, since we want to look at used memory. */
-			fprintf(stderr, "Page fault while trying to resolve guest address!\n");
-			goto out_unmap;
-		case 0x1:
-			/* Large page. We need to do a second-level lookup. (cf. Fig. B3-10)
-			 * The page table address base (bits 31..10) is in addr[31..10], the
-			 * L2 table index (bits 9..2) is in virt[19..12]. Bits 1..0 are 0x0. */
-			fprintf(stderr, "Warning: multi-level page walking code not tested at all!\n");
-			addr &= (addr & 0xFFFFFC00);
-			addr |= ((virt & 0xFF000)>>10);
-			if ((addr>>PAGE_SHIFT) != (pt_base_addr>>PAGE_SHIFT)) {
-				/* New address is in a different mage, get that one. */
-				xenforeignmemory_unmap(fmemh, map, 1);
-				map = xenforeignmemory_map(fmemh, domid, PROT_READ, 1, (xen_pfn_t *)&addr, &err);
-				if (err)
-					goto out_unmap;
+	*table_addr = *root & TTBR_LONG_BADDR;
+	return va_bits;
+
+out_granule:
+	DBG("only 4 KiB translation granules are supported\n");
+	return 0;
+#else
+	unsigned int t0sz, t1sz, N;
+
+	if (ctx->ttbcr & TTBCR_EAE) {
+		/* LPAE: TTBCR.T0SZ and T1SZ split the address space between
+		 * TTBR0 (bottom) and TTBR1 (top), see ARMv7 ARM B3.6.4. */
+		*long_desc = 1;
+		t0sz = TTBCR_T0SZ(ctx->ttbcr);
+		t1sz = TTBCR_T1SZ(ctx->ttbcr);
+		if (t1sz == 0) {
+			if (t0sz == 0 || (virt >> (32 - t0sz)) == 0) {
+				*root = ctx->ttbr0;
+				va_bits = 32 - t0sz;
 			}
-			offset = addr - pt_base_addr;
-			memcpy(&addr, map + offset, 4);
-			/* For the output address, the base (bits 31..16) is in addr[31..16], the
-			 * page index (bits 15..0) is in virt[15..0]. So splice them together.
-			 * The astute reader will notice there is an overlap, and bits 12..15
-			 * are used both in the second-level lookup and as part of the address. */
-			addr = (addr & ~((1<<16)-1)) | (virt & ((1<<16)-1));
-			break;
-		case 0x2:
-			/* Section entry. We're done with lookups. (cf. Fig. B3-9)
-			 * The base (bits 31..20) is in addr[31..20], the
-			 * index (bits 19..0) is in virt[19..0]. So splice them together. */
-			addr = (addr & ~((1<<20)-1)) | (virt & ((1<<20)-1));
-			break;
-		case 0x3:
-			/* Small page. We need to do a second-level lookup (cf. Fig. B3-11)
-			 * This first step is exactly the same as for large pages above. */
-			fprintf(stderr, "Warning: multi-level page walking code not tested at all!\n");
-			addr &= (addr & 0xFFFFFC00);
-			addr |= ((virt & 0xFF000)>>10);
-			if ((addr>>PAGE_SHIFT) != (pt_base_addr>>PAGE_SHIFT)) {
-				/* New address is in a different mage, get that one. */
-				xenforeignmemory_unmap(fmemh, map, 1);
-				map = xenforeignmemory_map(fmemh, domid, PROT_READ, 1, (xen_pfn_t *)&addr, &err);
-				if (err)
-					goto out_unmap;
+			else {
+				*root = ctx->ttbr1;
+				va_bits = 32;
 			}
-			offset = addr - pt_base_addr;
-			memcpy(&addr, map + offset, 4);
-			/* For the output address, the base (bits 31..12) is in addr[31..12], the
-			 * page index (bits 11..0) is in virt[11..0]. So splice them together. */
-			addr = (addr & ~((1<<12)-1)) | (virt & ((1<<12)-1));
-			break;
+		}
+		else if (virt >= (1ULL<<32) - (1ULL<<(32 - t1sz))) {
+			*root = ctx->ttbr1;
+			va_bits = 32 - t1sz;
+		}
+		else {
+			*root = ctx->ttbr0;
+			va_bits = 32 - t0sz;
+		}
+		*table_addr = *root & TTBR_LONG_BADDR;
+		return va_bits;
 	}
-	/* We now have the machine addres. But actually, we want an
-	 * MFN, so shift the address accordingly. */
-	addr >>= PAGE_SHIFT;
-	DBG("found section entry for %llx to mfn 0x%x\n", virt, addr);
-	xenforeignmemory_unmap(fmemh, map, 1);
-	return addr;
-
-out_unmap:
-	xenforeignmemory_unmap(fmemh, map, 1);
-	fprintf(stderr, "error trying to map domU memory (bogus frame pointers?)\n");
-	return 0;
+
+	/* Short descriptors: N defines the split between the two page tables.
+	 * If all the most-significant N bits of a virtual address are 0, then
+	 * use page table 0, otherwise use page table 1. The TTBR0 table
+	 * shrinks accordingly, and is aligned to its size (16 KiB >> N). */
+	*long_desc = 0;
+	N = TTBCR_N(ctx->ttbcr);
+	if (N > 0 && (virt >> (32 - N)) != 0) {
+		*root = ctx->ttbr1;
+		*table_addr = (uint32_t)ctx->ttbr1 & ~((1U<<14)-1);
+	}
+	else {
+		*root = ctx->ttbr0;
+		*table_addr = (uint32_t)ctx->ttbr0 & ~((1U<<(14-N))-1);
+	}
+	return 32;
+#endif
+}
+
+/* libxenforeignmemory doesn't provide an address translation method like libxc does,
+ * so it needs a replacement function to walk the page tables. As on x86, the
+ * results and the page table mappings are kept in the translation cache.
+ */
+static unsigned long translate(struct xlat_domain *d, int vcpu, unsigned long long virt)
+{
+	vcpu_guest_context_t *ctx;
+	uint64_t root, table_addr;
+	unsigned long mfn;
+	int va_bits, long_desc, shift = PAGE_SHIFT;
+
+	ctx = xlat_vcpu_context(d, vcpu);
+	if (!ctx)
+		return 0;
+
+	va_bits = select_table(ctx, virt, &root, &table_addr, &long_desc);
+	if (!va_bits)
+		return 0;
+	if (xlat_lookup(d, root, virt, &mfn)) {
+		DBG("cached translation for %llx to mfn 0x%lx\n", virt, mfn);
+		return mfn;
+	}
+	DBG("page table base address is 0x%"PRIx64" (%s descriptors)\n",
+			table_addr, long_desc ? "long" : "short");
+
+	if (long_desc)
+		mfn = page_walk_arm_long(table_addr, va_bits, virt, map_table, d, &shift);
+	else
+		mfn = page_walk_arm_short(table_addr, (uint32_t)virt, map_table, d, &shift);
+	DBG("found entry for %llx to mfn 0x%lx (page size 1<<%d)\n", virt, mfn, shift);
+	/* cache failures too, and sections/blocks as a whole */
+	xlat_insert(d, root, virt, mfn, shift);
+	return mfn;
+}
+
+unsigned long xen_translate_foreign_address(int domid, int vcpu, unsigned long long virt)
+{
+	struct xlat_domain *d;
+	unsigned long mfn;
+
+	d = xlat_domain(domid);
+	if (!d)
+		return 0;
+	// stack walkers on other threads may be translating as well
+	xlat_lock(d);
+	mfn = translate(d, vcpu, virt);
+	xlat_unlock(d);
+	return mfn;
 }
 #endif /* HYPERCALL_XENCALL */
 
@@ -172,9 +211,9 @@ void xen_map_domu_page(int domid, int vcpu, uint64_t addr, unsigned long *mfn, v
 	*mfn = xen_translate_foreign_address(domid, vcpu, addr);
 	if (*mfn) {
 		// This works since size is 1, so the array has size 1, so it's just a pointer to an int
-		*buf = xenforeignmemory_map(fmemh, domid, PROT_READ, 1, (xen_pfn_t *)mfn, &err);
+		*buf = XEN_CALL(XEN_CALL_MAP, xenforeignmemory_map(fmemh, domid, PROT_READ, 1, (xen_pfn_t *)mfn, &err));
 		if (err) {
-			xenforeignmemory_unmap(fmemh, *buf, 1);
+			XEN_CALL(XEN_CALL_UNMAP, xenforeignmemory_unmap(fmemh, *buf, 1));
 			*buf = 0;
 		}
 	}
@@ -182,9 +221,9 @@ void xen_map_domu_page(int domid, int vcpu, uint64_t addr, unsigned long *mfn, v
 		*buf = 0;
 	}
 #elif defined(HYPERCALL_LIBXC)
-	*mfn = xc_translate_foreign_address(xc_handle, domid, vcpu, addr);
+	*mfn = XEN_CALL(XEN_CALL_TRANSLATE, xc_translate_foreign_address(xc_handle, domid, vcpu, addr));
 	DBG("addr = %"PRIx64", mfn = %lx\n", addr, *mfn);
-	*buf = xc_map_foreign_range(xc_handle, domid, XC_PAGE_SIZE, PROT_READ, *mfn);
+	*buf = XEN_CALL(XEN_CALL_MAP, xc_map_foreign_range(xc_handle, domid, XC_PAGE_SIZE, PROT_READ, *mfn));
 #endif
 	DBG("virt addr %"PRIx64" has mfn %lx and was mapped to %p\n", addr, *mfn, *buf);
 }
@@ -192,18 +231,52 @@ void xen_map_domu_page(int domid, int vcpu, uint64_t addr, unsigned long *mfn, v
 guest_word_t frame_pointer(vcpu_guest_context_transparent_t *vc) {
 	// this only works for ARM mode so far!
 	// also, it might not work at all on AACPI ABI!
+#if defined(__aarch64__)
+	// AAPCS64 uses x29 as the frame pointer
+#if defined(HYPERCALL_XENCALL)
+	return vc->user_regs.x29;
+#elif defined(HYPERCALL_LIBXC)
+	return vc->c.user_regs.x29;
+#endif
+#else
 #if defined(HYPERCALL_XENCALL)
 	return vc->user_regs.r11_usr;
 #elif defined(HYPERCALL_LIBXC)
 	return vc->c.user_regs.r11_usr;
 #endif
+#endif /* architecture */
+}
+
+guest_word_t stack_pointer(vcpu_guest_context_transparent_t *vc) {
+	// assumes the guest kernel runs in SVC mode (AArch32) or EL1 (AArch64)
+#if defined(__aarch64__)
+#if defined(HYPERCALL_XENCALL)
+	return vc->user_regs.sp_el1;
+#elif defined(HYPERCALL_LIBXC)
+	return vc->c.user_regs.sp_el1;
+#endif
+#else
+#if defined(HYPERCALL_XENCALL)
+	return vc->user_regs.sp_svc;
+#elif defined(HYPERCALL_LIBXC)
+	return vc->c.user_regs.sp_svc;
+#endif
+#endif /* architecture */
 }
 
 guest_word_t instruction_pointer(vcpu_guest_context_transparent_t *vc) {
 	// this only works for ARM mode so far!
+#if defined(__aarch64__)
+#if defined(HYPERCALL_XENCALL)
+	return vc->user_regs.pc64;
+#elif defined(HYPERCALL_LIBXC)
+	return vc->c.user_regs.pc64;
+#endif
+#else
 #if defined(HYPERCALL_XENCALL)
 	return vc->user_regs.pc32;
 #elif defined(HYPERCALL_LIBXC)
 	return vc->c.user_regs.pc32;
 #endif
+#endif /* architecture */
 }
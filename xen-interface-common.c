@@ -33,17 +33,341 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <xen-interface.h>
+#include <instrument.h>
 
 #if defined(HYPERCALL_XENCALL)
-xencall_handle *callh;
-xenforeignmemory_handle *fmemh;
+#include <page-cache.h>
+
+__thread xencall_handle *callh;
+__thread xenforeignmemory_handle *fmemh;
+
+#define XLAT_TLB_ENTRIES       4096 /* direct-mapped, needs to be a power of two */
+#define XLAT_TABLE_CACHE_PAGES 128  /* page table pages kept mapped per domain */
+/* Failed translations are only trusted for a while (counted in vCPU context
+ * updates), in case the guest maps the page later on. */
+#define XLAT_NEGATIVE_TTL      4096
+
+/* An entry covers one page of 1<<shift bytes, so a single entry for a
+ * 2 MiB or 1 GiB mapping serves every 4 KiB page inside it. */
+typedef struct {
+	uint64_t root;
+	uint64_t vpage;             // virt >> shift
+	unsigned long mfn;          // first frame of the page, 0 if virt is not mapped
+	unsigned long generation;   // context update count at insertion time
+	int shift;
+	int valid;
+} xlat_entry_t;
+
+struct xlat_domain {
+	int domid;
+	int wordsize;
+	unsigned int nr_vcpus;
+	vcpu_guest_context_t *ctx;  // last context fetched per vCPU
+	int *ctx_valid;
+	unsigned long generation;
+	unsigned long page_shifts;  // bitmask of the page sizes in the TLB
+	page_cache_t *tables;
+	pthread_mutex_t lock;       // held for the whole of a translation
+	xlat_stats_t stats;
+	xlat_entry_t tlb[XLAT_TLB_ENTRIES];
+	struct xlat_domain *next;
+};
+
+static struct xlat_domain *xlat_domains = NULL;
+static pthread_mutex_t xlat_domains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned int xlat_slot(uint64_t root, uint64_t vpage, int shift)
+{
+	uint64_t h = (vpage ^ ((root + shift) * 0xff51afd7ed558ccdULL)) * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(h >> 32) & (XLAT_TLB_ENTRIES - 1);
+}
+
+struct xlat_domain *xlat_domain(int domid)
+{
+	struct xlat_domain *d;
+
+	pthread_mutex_lock(&xlat_domains_lock);
+	for (d = xlat_domains; d != NULL; d = d->next)
+		if (d->domid == domid)
+			goto out;
+
+	d = calloc(1, sizeof(struct xlat_domain));
+	if (!d)
+		goto out;
+	d->tables = page_cache_create(XLAT_TABLE_CACHE_PAGES);
+	if (!d->tables) {
+		free(d);
+		d = NULL;
+		goto out;
+	}
+	pthread_mutex_init(&d->lock, NULL);
+	d->domid = domid;
+	d->next = xlat_domains;
+	xlat_domains = d;
+out:
+	pthread_mutex_unlock(&xlat_domains_lock);
+	return d;
+}
+
+void xlat_lock(struct xlat_domain *d)
+{
+	pthread_mutex_lock(&d->lock);
+}
+
+void xlat_unlock(struct xlat_domain *d)
+{
+	pthread_mutex_unlock(&d->lock);
+}
+
+void xlat_domain_release(int domid)
+{
+	struct xlat_domain **pd, *d;
+
+	pthread_mutex_lock(&xlat_domains_lock);
+	for (pd = &xlat_domains; *pd != NULL; pd = &(*pd)->next) {
+		d = *pd;
+		if (d->domid != domid)
+			continue;
+		*pd = d->next;
+		page_cache_destroy(d->tables);
+		pthread_mutex_destroy(&d->lock);
+		free(d->ctx);
+		free(d->ctx_valid);
+		free(d);
+		break;
+	}
+	pthread_mutex_unlock(&xlat_domains_lock);
+}
+
+int xlat_get_stats(int domid, xlat_stats_t *stats)
+{
+	struct xlat_domain *d;
+	int ret = -1;
+
+	pthread_mutex_lock(&xlat_domains_lock);
+	for (d = xlat_domains; d != NULL; d = d->next) {
+		if (d->domid != domid)
+			continue;
+		*stats = d->stats;
+		stats->table_hits = d->tables->hits;
+		stats->table_misses = d->tables->misses;
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&xlat_domains_lock);
+	return ret;
+}
+
+static int xlat_grow(struct xlat_domain *d, unsigned int vcpu)
+{
+	vcpu_guest_context_t *ctx;
+	int *valid;
+	unsigned int nr = vcpu + 1;
+
+	if (vcpu < d->nr_vcpus)
+		return 0;
+	ctx = realloc(d->ctx, nr * sizeof(vcpu_guest_context_t));
+	if (!ctx)
+		return -1;
+	d->ctx = ctx;
+	valid = realloc(d->ctx_valid, nr * sizeof(int));
+	if (!valid)
+		return -1;
+	memset(valid + d->nr_vcpus, 0, (nr - d->nr_vcpus) * sizeof(int));
+	d->ctx_valid = valid;
+	d->nr_vcpus = nr;
+	return 0;
+}
+
+/* Drop all translations made through root, unless another vCPU still uses it. */
+static void xlat_flush_root(struct xlat_domain *d, uint64_t root, unsigned int except_vcpu)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nr_vcpus; i++)
+		if (i != except_vcpu && d->ctx_valid[i] && xlat_context_root(&d->ctx[i]) == root)
+			return;
+	for (i = 0; i < XLAT_TLB_ENTRIES; i++)
+		if (d->tlb[i].root == root)
+			d->tlb[i].valid = 0;
+	d->stats.flushes++;
+}
+
+static void xlat_note_context(int domid, int vcpu, vcpu_guest_context_t *vc)
+{
+	struct xlat_domain *d = xlat_domain(domid);
+	uint64_t old_root;
+
+	if (!d || xlat_grow(d, vcpu))
+		return;
+	d->generation++;
+	if (d->ctx_valid[vcpu]) {
+		old_root = xlat_context_root(&d->ctx[vcpu]);
+		if (old_root != xlat_context_root(vc)) {
+			DBG("vcpu %d switched page tables, flushing translations\n", vcpu);
+			xlat_flush_root(d, old_root, vcpu);
+		}
+	}
+	if (vc != &d->ctx[vcpu])
+		memcpy(&d->ctx[vcpu], vc, sizeof(vcpu_guest_context_t));
+	d->ctx_valid[vcpu] = 1;
+}
+
+vcpu_guest_context_t *xlat_vcpu_context(struct xlat_domain *d, int vcpu)
+{
+	vcpu_guest_context_t ctx;
+
+	if ((unsigned int)vcpu >= d->nr_vcpus || !d->ctx_valid[vcpu])
+		// this records the context as a side effect
+		if (get_vcpu_context(d->domid, vcpu, &ctx))
+			return NULL;
+	if ((unsigned int)vcpu >= d->nr_vcpus)
+		return NULL;
+	return &d->ctx[vcpu];
+}
+
+int xlat_word_size(struct xlat_domain *d)
+{
+	if (d->wordsize <= 0)
+		d->wordsize = get_word_size(d->domid);
+	return d->wordsize;
+}
+
+/* Returns 1 if the translation of virt is cached (with *mfn set to 0 if virt
+ * is known not to be mapped), 0 if the page tables have to be walked. */
+int xlat_lookup(struct xlat_domain *d, uint64_t root, uint64_t virt, unsigned long *mfn)
+{
+	unsigned long shifts = d->page_shifts;
+	xlat_entry_t *e;
+	int shift;
+
+	// try every page size we have seen so far, smallest first
+	while (shifts) {
+		shift = __builtin_ctzl(shifts);
+		shifts &= shifts - 1;
+		e = &d->tlb[xlat_slot(root, virt >> shift, shift)];
+		if (!e->valid || e->root != root || e->shift != shift || e->vpage != (virt >> shift))
+			continue;
+		if (e->mfn == 0) {
+			if (d->generation - e->generation >= XLAT_NEGATIVE_TTL) {
+				e->valid = 0;
+				break;
+			}
+			d->stats.negative_hits++;
+			*mfn = 0;
+			return 1;
+		}
+		d->stats.hits++;
+		*mfn = e->mfn + ((virt >> PAGE_SHIFT) & ((1UL << (shift - PAGE_SHIFT)) - 1));
+		return 1;
+	}
+	d->stats.misses++;
+	return 0;
+}
+
+/* Record that virt translates to mfn, and that it lies in a page of
+ * 1<<shift bytes. Failed translations (mfn == 0) always use 4 KiB. */
+void xlat_insert(struct xlat_domain *d, uint64_t root, uint64_t virt, unsigned long mfn, int shift)
+{
+	xlat_entry_t *e;
+
+	if (mfn == 0)
+		shift = PAGE_SHIFT;
+	e = &d->tlb[xlat_slot(root, virt >> shift, shift)];
+	e->root = root;
+	e->vpage = virt >> shift;
+	e->mfn = mfn ? mfn - ((virt >> PAGE_SHIFT) & ((1UL << (shift - PAGE_SHIFT)) - 1)) : 0;
+	e->generation = d->generation;
+	e->shift = shift;
+	e->valid = 1;
+	d->page_shifts |= 1UL << shift;
+}
+
+/* Map a page table page, or reuse the mapping from an earlier walk.
+ * The mapping stays owned by the translation cache. */
+void *xlat_map_table(struct xlat_domain *d, xen_pfn_t pfn)
+{
+	guest_word_t base = (guest_word_t)pfn << PAGE_SHIFT;
+	void *map;
+	int err = 0;
+
+	map = page_cache_lookup(d->tables, base);
+	if (map)
+		return map;
+	map = XEN_CALL(XEN_CALL_MAP, xenforeignmemory_map(fmemh, d->domid, PROT_READ, 1, &pfn, &err));
+	if (map == NULL)
+		return NULL;
+	if (err) {
+		XEN_CALL(XEN_CALL_UNMAP, xenforeignmemory_unmap(fmemh, map, 1));
+		return NULL;
+	}
+	page_cache_insert(d->tables, base, pfn, map);
+	return map;
+}
 #endif
 #if defined(HYPERCALL_LIBXC)
-xc_interface *xc_handle;
+__thread xc_interface *xc_handle;
 #endif
 
+static const char *xen_call_names[XEN_CALL_NR_TYPES] = {
+	[XEN_CALL_GETDOMAININFO] = "getdomaininfo",
+	[XEN_CALL_GETDOMAININFOLIST] = "getdomaininfolist",
+	[XEN_CALL_GETVCPUCONTEXT] = "getvcpucontext",
+	[XEN_CALL_GETVCPUINFO] = "getvcpuinfo",
+	[XEN_CALL_PAUSEDOMAIN] = "pausedomain",
+	[XEN_CALL_UNPAUSEDOMAIN] = "unpausedomain",
+	[XEN_CALL_ADDRESS_SIZE] = "get_address_size",
+	[XEN_CALL_MULTICALL] = "multicall",
+	[XEN_CALL_TRANSLATE] = "translate",
+	[XEN_CALL_MAP] = "map",
+	[XEN_CALL_UNMAP] = "unmap",
+};
+
+static __thread xen_call_stats_t thread_calls[XEN_CALL_NR_TYPES];
+static xen_call_stats_t total_calls[XEN_CALL_NR_TYPES];
+static pthread_mutex_t total_calls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *xen_call_name(xen_call_type_t type) {
+	if (type >= XEN_CALL_NR_TYPES)
+		return "unknown";
+	return xen_call_names[type];
+}
+
+void xen_call_end(xen_call_type_t type, uint64_t begin) {
+	thread_calls[type].count++;
+	thread_calls[type].nsec += sample_timer_now() - begin;
+	if (type == XEN_CALL_MAP)
+		INSTR_COUNT(INSTR_MAPPINGS);
+	else if (type != XEN_CALL_UNMAP)
+		INSTR_COUNT(INSTR_HYPERCALLS);
+}
+
+void xen_call_get_stats(xen_call_stats_t stats[XEN_CALL_NR_TYPES]) {
+	pthread_mutex_lock(&total_calls_lock);
+	memcpy(stats, total_calls, sizeof(total_calls));
+	pthread_mutex_unlock(&total_calls_lock);
+}
+
+/* add this thread's numbers to the totals */
+static void xen_call_merge(void) {
+	int i;
+
+	pthread_mutex_lock(&total_calls_lock);
+	for (i = 0; i < XEN_CALL_NR_TYPES; i++) {
+		total_calls[i].count += thread_calls[i].count;
+		total_calls[i].nsec += thread_calls[i].nsec;
+	}
+	pthread_mutex_unlock(&total_calls_lock);
+	memset(thread_calls, 0, sizeof(thread_calls));
+}
+
 int xen_interface_open(void) {
 #if defined(HYPERCALL_XENCALL)
 	callh = xencall_open(NULL, XENCALL_OPENFLAG_NON_REENTRANT);
@@ -61,7 +385,8 @@ int xen_interface_open(void) {
 	return 0;
 }
 
-int xen_interface_close(void) {
+int xen_interface_close_thread(void) {
+	xen_call_merge();
 #if defined(HYPERCALL_XENCALL)
 	if (xenforeignmemory_close(fmemh))
 		return -2;
@@ -74,6 +399,24 @@ int xen_interface_close(void) {
 	return 0;
 }
 
+int xen_interface_close(void) {
+#if defined(HYPERCALL_XENCALL)
+	// translation caches hold foreign mappings, drop them first
+	while (xlat_domains != NULL)
+		xlat_domain_release(xlat_domains->domid);
+#endif
+	return xen_interface_close_thread();
+}
+
+/* Release a page mapped with xen_map_domu_page(). */
+void xen_unmap_domu_page(void *buf) {
+#if defined(HYPERCALL_XENCALL)
+	XEN_CALL(XEN_CALL_UNMAP, xenforeignmemory_unmap(fmemh, buf, 1));
+#elif defined(HYPERCALL_LIBXC)
+	XEN_CALL(XEN_CALL_UNMAP, munmap(buf, XC_PAGE_SIZE));
+#endif
+}
+
 int get_domain_state(int domid, unsigned int *state) {
 	int retval;
 #if defined(HYPERCALL_XENCALL)
@@ -81,12 +424,12 @@ int get_domain_state(int domid, unsigned int *state) {
 	domctl.domain = (domid_t)domid;
 	domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
 	domctl.cmd = XEN_DOMCTL_getdomaininfo;
-	retval = xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl));
+	retval = XEN_CALL(XEN_CALL_GETDOMAININFO, xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl)));
 	*state = domctl.u.getdomaininfo.flags;
 	return retval;
 #elif defined(HYPERCALL_LIBXC)
 	xc_dominfo_t info;
-	retval = xc_domain_getinfo(xc_handle, domid, 1, &info);
+	retval = XEN_CALL(XEN_CALL_GETDOMAININFO, xc_domain_getinfo(xc_handle, domid, 1, &info));
 	*state |= (info.shutdown_reason << XEN_DOMINF_shutdownshift);
 	if (info.dying)
 		*state |= XEN_DOMINF_dying;
@@ -110,15 +453,171 @@ int get_domain_state(int domid, unsigned int *state) {
 
 int get_vcpu_context(int domid, int vcpu, vcpu_guest_context_transparent_t *vc) {
 #if defined(HYPERCALL_XENCALL)
+	int ret;
 	struct xen_domctl domctl;
 	domctl.domain = (domid_t)domid;
 	domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
 	domctl.cmd = XEN_DOMCTL_getvcpucontext;
 	domctl.u.vcpucontext.vcpu = (uint16_t)vcpu;
 	domctl.u.vcpucontext.ctxt.p = (vcpu_guest_context_t *)vc;
-	return xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl));
+	ret = XEN_CALL(XEN_CALL_GETVCPUCONTEXT, xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl)));
+	// remember it, so address translation doesn't have to fetch it again
+	if (ret == 0)
+		xlat_note_context(domid, vcpu, vc);
+	return ret;
+#elif defined(HYPERCALL_LIBXC)
+	return XEN_CALL(XEN_CALL_GETVCPUCONTEXT, xc_vcpu_getcontext(xc_handle, domid, vcpu, vc));
+#endif
+}
+
+#if defined(HYPERCALL_XENCALL)
+static multicall_entry_t *batch_calls = NULL;
+static struct xen_domctl *batch_domctls = NULL;
+static int batch_allocated = 0;
+
+/* make sure there is room for nr domctls in the batch buffers */
+static int batch_reserve(int nr) {
+	multicall_entry_t *new_calls;
+	struct xen_domctl *new_domctls;
+
+	if (nr <= batch_allocated)
+		return 0;
+	new_calls = realloc(batch_calls, nr * sizeof(multicall_entry_t));
+	if (!new_calls)
+		return -1;
+	batch_calls = new_calls;
+	new_domctls = realloc(batch_domctls, nr * sizeof(struct xen_domctl));
+	if (!new_domctls)
+		return -1;
+	batch_domctls = new_domctls;
+	batch_allocated = nr;
+	return 0;
+}
+
+/**
+ * Issue the first nr domctls in batch_domctls as one multicall, so a whole
+ * batch takes a single trap. If the hypervisor doesn't let us batch
+ * domctls, issue them one by one (and don't try batching again). The
+ * result of each ends up in rets, and fallback calls are accounted as type.
+ */
+static void batch_issue(int nr, int *rets, xen_call_type_t type) {
+	static bool multicall_broken = false;
+	int i, ret;
+
+	if (!multicall_broken) {
+		for (i = 0; i < nr; i++) {
+			memset(&batch_calls[i], 0, sizeof(multicall_entry_t));
+			batch_calls[i].op = __HYPERVISOR_domctl;
+			batch_calls[i].args[0] = (unsigned long)&batch_domctls[i];
+		}
+		ret = XEN_CALL(XEN_CALL_MULTICALL, xencall2(callh, __HYPERVISOR_multicall, (unsigned long)batch_calls, nr));
+		if (ret == 0) {
+			for (i = 0; i < nr; i++)
+				rets[i] = (int)(long)batch_calls[i].result;
+			return;
+		}
+		DBG("multicall failed (ret=%d), falling back to single hypercalls\n", ret);
+		multicall_broken = true;
+	}
+	for (i = 0; i < nr; i++)
+		rets[i] = XEN_CALL(type, xencall1(callh, __HYPERVISOR_domctl, (unsigned long)&batch_domctls[i]));
+}
+#endif
+
+/**
+ * Fetch the contexts of vCPUs 0 to nr_vcpus-1 into vcs, except for those
+ * with a nonzero entry in skip (which may be NULL). With libxencall, this
+ * issues all the getvcpucontext domctls as one multicall, so fetching the
+ * contexts of a paused domain takes a single trap instead of one per vCPU.
+ * The result for each fetched vCPU ends up in rets. Returns 0 if the
+ * contexts could be requested at all (even if some of them failed), a
+ * negative value otherwise.
+ */
+int get_vcpu_contexts(int domid, int nr_vcpus, const unsigned char *skip,
+		vcpu_guest_context_transparent_t *vcs, int *rets) {
+	int vcpu;
+#if defined(HYPERCALL_XENCALL)
+	static int *batch_rets = NULL;
+	int *new_rets;
+	int i, nr = 0;
+
+	if (batch_reserve(nr_vcpus))
+		goto fallback;
+	new_rets = realloc(batch_rets, nr_vcpus * sizeof(int));
+	if (!new_rets)
+		goto fallback;
+	batch_rets = new_rets;
+	for (vcpu = 0; vcpu < nr_vcpus; vcpu++) {
+		if (skip && skip[vcpu])
+			continue;
+		batch_domctls[nr].domain = (domid_t)domid;
+		batch_domctls[nr].interface_version = XEN_DOMCTL_INTERFACE_VERSION;
+		batch_domctls[nr].cmd = XEN_DOMCTL_getvcpucontext;
+		batch_domctls[nr].u.vcpucontext.vcpu = (uint16_t)vcpu;
+		batch_domctls[nr].u.vcpucontext.ctxt.p = (vcpu_guest_context_t *)&vcs[vcpu];
+		nr++;
+	}
+	if (nr)
+		batch_issue(nr, batch_rets, XEN_CALL_GETVCPUCONTEXT);
+	for (i = 0; i < nr; i++) {
+		vcpu = batch_domctls[i].u.vcpucontext.vcpu;
+		rets[vcpu] = batch_rets[i];
+		if (rets[vcpu] == 0)
+			xlat_note_context(domid, vcpu, &vcs[vcpu]);
+	}
+	return 0;
+
+fallback:
+#endif
+	for (vcpu = 0; vcpu < nr_vcpus; vcpu++)
+		if (!skip || !skip[vcpu])
+			rets[vcpu] = get_vcpu_context(domid, vcpu, &vcs[vcpu]);
+	return 0;
+}
+
+/**
+ * Find out which of the vCPUs 0 to nr_vcpus-1 are online and which are
+ * blocked (i.e., idle), as a combination of VCPU_ONLINE and VCPU_BLOCKED
+ * in states. With libxencall, this is a single multicall again. Returns 0
+ * on success, or a negative value if the state of any vCPU is unknown.
+ */
+int get_vcpu_states(int domid, int nr_vcpus, unsigned char *states) {
+	int vcpu;
+#if defined(HYPERCALL_XENCALL)
+	static int *rets = NULL;
+	int *new_rets;
+
+	if (batch_reserve(nr_vcpus))
+		return -ENOMEM;
+	new_rets = realloc(rets, nr_vcpus * sizeof(int));
+	if (!new_rets)
+		return -ENOMEM;
+	rets = new_rets;
+	for (vcpu = 0; vcpu < nr_vcpus; vcpu++) {
+		batch_domctls[vcpu].domain = (domid_t)domid;
+		batch_domctls[vcpu].interface_version = XEN_DOMCTL_INTERFACE_VERSION;
+		batch_domctls[vcpu].cmd = XEN_DOMCTL_getvcpuinfo;
+		batch_domctls[vcpu].u.getvcpuinfo.vcpu = vcpu;
+	}
+	batch_issue(nr_vcpus, rets, XEN_CALL_GETVCPUINFO);
+	for (vcpu = 0; vcpu < nr_vcpus; vcpu++) {
+		if (rets[vcpu] < 0)
+			return rets[vcpu];
+		states[vcpu] = (batch_domctls[vcpu].u.getvcpuinfo.online ? VCPU_ONLINE : 0) |
+			(batch_domctls[vcpu].u.getvcpuinfo.blocked ? VCPU_BLOCKED : 0);
+	}
+	return 0;
 #elif defined(HYPERCALL_LIBXC)
-	return xc_vcpu_getcontext(xc_handle, domid, vcpu, vc);
+	xc_vcpuinfo_t info;
+	int ret;
+
+	for (vcpu = 0; vcpu < nr_vcpus; vcpu++) {
+		ret = XEN_CALL(XEN_CALL_GETVCPUINFO, xc_vcpu_getinfo(xc_handle, domid, vcpu, &info));
+		if (ret < 0)
+			return ret;
+		states[vcpu] = (info.online ? VCPU_ONLINE : 0) | (info.blocked ? VCPU_BLOCKED : 0);
+	}
+	return 0;
 #endif
 }
 
@@ -128,9 +627,9 @@ int pause_domain(int domid) {
 	domctl.domain = (domid_t)domid;
 	domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
 	domctl.cmd = XEN_DOMCTL_pausedomain;
-	return xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl));
+	return XEN_CALL(XEN_CALL_PAUSEDOMAIN, xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl)));
 #elif defined(HYPERCALL_LIBXC)
-	return xc_domain_pause(xc_handle, domid);
+	return XEN_CALL(XEN_CALL_PAUSEDOMAIN, xc_domain_pause(xc_handle, domid));
 #endif
 }
 
@@ -140,9 +639,9 @@ int unpause_domain(int domid) {
 	domctl.domain = (domid_t)domid;
 	domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
 	domctl.cmd = XEN_DOMCTL_unpausedomain;
-	return xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl));
+	return XEN_CALL(XEN_CALL_UNPAUSEDOMAIN, xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl)));
 #elif defined(HYPERCALL_LIBXC)
-	return xc_domain_unpause(xc_handle, domid);
+	return XEN_CALL(XEN_CALL_UNPAUSEDOMAIN, xc_domain_unpause(xc_handle, domid));
 #endif
 }
 
@@ -153,7 +652,7 @@ int get_max_vcpu_id(int domid) {
 	domctl.domain = (domid_t)domid;
 	domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
 	domctl.cmd = XEN_DOMCTL_getdomaininfo;
-	ret = xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl));
+	ret = XEN_CALL(XEN_CALL_GETDOMAININFO, xencall1(callh, __HYPERVISOR_domctl, (unsigned long)(&domctl)));
 	if (ret < 0)
 		return -5;
 	else
@@ -161,10 +660,47 @@ int get_max_vcpu_id(int domid) {
 #elif defined(HYPERCALL_LIBXC)
 	int ret;
 	xc_dominfo_t dominfo;
-	ret = xc_domain_getinfo(xc_handle, domid, 1, &dominfo);
+	ret = XEN_CALL(XEN_CALL_GETDOMAININFO, xc_domain_getinfo(xc_handle, domid, 1, &dominfo));
 	if (ret < 0)
 		return -5;
 	else
 		return dominfo.max_vcpu_id;
 #endif
 }
+
+int get_domain_list(int *domids, int max) {
+#if defined(HYPERCALL_XENCALL)
+	struct xen_sysctl sysctl;
+	xen_domctl_getdomaininfo_t *info;
+	int i, ret;
+
+	info = calloc(max, sizeof(xen_domctl_getdomaininfo_t));
+	if (!info)
+		return -ENOMEM;
+	sysctl.cmd = XEN_SYSCTL_getdomaininfolist;
+	sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+	sysctl.u.getdomaininfolist.first_domain = 0;
+	sysctl.u.getdomaininfolist.max_domains = max;
+	set_xen_guest_handle(sysctl.u.getdomaininfolist.buffer, info);
+	ret = XEN_CALL(XEN_CALL_GETDOMAININFOLIST, xencall1(callh, __HYPERVISOR_sysctl, (unsigned long)(&sysctl)));
+	if (ret == 0) {
+		ret = sysctl.u.getdomaininfolist.num_domains;
+		for (i = 0; i < ret; i++)
+			domids[i] = info[i].domain;
+	}
+	free(info);
+	return ret;
+#elif defined(HYPERCALL_LIBXC)
+	xc_dominfo_t *info;
+	int i, ret;
+
+	info = calloc(max, sizeof(xc_dominfo_t));
+	if (!info)
+		return -ENOMEM;
+	ret = XEN_CALL(XEN_CALL_GETDOMAININFOLIST, xc_domain_getinfo(xc_handle, 0, max, info));
+	for (i = 0; i < ret; i++)
+		domids[i] = info[i].domid;
+	free(info);
+	return ret;
+#endif
+}